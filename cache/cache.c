@@ -0,0 +1,655 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <utime.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <sys/wait.h>
+#include <time.h>
+#include "cache.h"
+#include "../source/source.h"
+
+/*
+Content-addressed output cache for HQ9+ engines.
+
+The output of a HQ9+ program only depends on its source bytes and on the engine
+rendering it, so it is stored under a FNV-1a hash of both:
+    <key>.out   complete output, for outputs up to CACHE_RECIPE_THRESHOLD bytes
+    <key>.rcp   recipe of instruction runs ("H 3\n9 1\n"), for larger outputs
+
+Recipes are replayed from segment files, which hold the output of one instruction:
+    <engine key>.H   hello world
+    <engine key>.9   lyrics
+    <key>.Q          source code
+
+Everything is sent to stdout with sendfile. Segments smaller than CACHE_CHUNK are
+repeated into a buffer of at least CACHE_CHUNK bytes first, so a run costs one
+write per chunk instead of one per instruction. Every hit touches the files it used,
+and the least recently used files are evicted when the directory outgrows its limit.
+
+On a miss the output is teed to stdout and to the capture file while it is
+produced. Captures of processes that died before cache_end are removed by the
+next eviction once they are older than CACHE_STALE_SECONDS.
+
+Enable the cache by pointing HQ9_CACHE_DIR to an existing directory.
+HQ9_CACHE_LIMIT bounds its size in bytes (default 64 MiB).
+*/
+
+#define CACHE_DEFAULT_LIMIT (64UL * 1024 * 1024)
+#define CACHE_RECIPE_THRESHOLD (1024UL * 1024)
+#define CACHE_CHUNK (64 * 1024)
+#define CACHE_STALE_SECONDS 60
+
+#define FNV_OFFSET_BASIS 14695981039346656037UL
+#define FNV_PRIME 1099511628211UL
+
+struct cache_file {
+  char name[256];
+  off_t size;
+  time_t modified;
+};
+
+static unsigned long hash_bytes(unsigned long hash, const char* bytes, size_t length)
+{
+    size_t i;
+    for (i = 0; i < length; i++)
+    {
+        hash ^= (unsigned char) bytes[i];
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
+
+static void entry_path(struct cache* const cache, char* path, const char* key, const char* extension)
+{
+    snprintf(path, CACHE_PATH_MAX, "%s/%s.%s", cache->directory, key, extension);
+}
+
+static void segment_path(struct cache* const cache, char* path, char instruction)
+{
+    if (instruction == 'Q')
+    {
+        entry_path(cache, path, cache->key, "Q");
+    }
+    else
+    {
+        entry_path(cache, path, cache->engine_key, instruction == 'H' ? "H" : "9");
+    }
+}
+
+static void temporary_path(char* path, const char* final_path)
+{
+    snprintf(path, CACHE_PATH_MAX, "%s.tmp%ld", final_path, (long) getpid());
+}
+
+static int redirect_stdout(const char* path)
+{
+    int fd;
+    int saved;
+
+    fflush(stdout);
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        return -1;
+    }
+    saved = dup(STDOUT_FILENO);
+    dup2(fd, STDOUT_FILENO);
+    close(fd);
+    return saved;
+}
+
+static void restore_stdout(int saved)
+{
+    fflush(stdout);
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+}
+
+static int write_all(int fd, const char* bytes, size_t length);
+
+/* child process copying everything written to the pipe to stdout and the capture file */
+static void tee_output(int input, int capture)
+{
+    char buffer[65536];
+    ssize_t count;
+    int failed = 0;
+
+    while ((count = read(input, buffer, sizeof(buffer))) != 0)
+    {
+        if (count < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            _exit(EXIT_FAILURE);
+        }
+        if (write_all(STDOUT_FILENO, buffer, count) != 0)
+        {
+            _exit(EXIT_FAILURE);
+        }
+        /* a full disk only loses the capture, never the output */
+        if (!failed && write_all(capture, buffer, count) != 0)
+        {
+            failed = 1;
+        }
+    }
+    _exit(failed ? EXIT_FAILURE : EXIT_SUCCESS);
+}
+
+/* redirect stdout into a tee process, returns the saved stdout or -1 */
+static int start_tee(struct cache* const cache)
+{
+    int capture;
+    int fds[2];
+    int saved;
+    pid_t pid;
+
+    fflush(stdout);
+    capture = open(cache->capture_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (capture < 0)
+    {
+        return -1;
+    }
+    if (pipe(fds) != 0)
+    {
+        close(capture);
+        unlink(cache->capture_path);
+        return -1;
+    }
+    pid = fork();
+    if (pid < 0)
+    {
+        close(fds[0]);
+        close(fds[1]);
+        close(capture);
+        unlink(cache->capture_path);
+        return -1;
+    }
+    if (pid == 0)
+    {
+        close(fds[1]);
+        tee_output(fds[0], capture);
+    }
+
+    close(fds[0]);
+    close(capture);
+    saved = dup(STDOUT_FILENO);
+    dup2(fds[1], STDOUT_FILENO);
+    close(fds[1]);
+    cache->tee_process = pid;
+    return saved;
+}
+
+/* copy a whole file to stdout, sendfile with a read/write fallback */
+static int send_file(int fd, off_t size)
+{
+    off_t offset = 0;
+    ssize_t sent;
+    char buffer[65536];
+
+    while (offset < size)
+    {
+        sent = sendfile(STDOUT_FILENO, fd, &offset, size - offset);
+        if (sent > 0)
+        {
+            continue;
+        }
+        if (sent < 0 && (errno == EINVAL || errno == ENOSYS))
+        {
+            /* stdout does not support sendfile (e.g. some character devices) */
+            break;
+        }
+        return -1;
+    }
+
+    while (offset < size)
+    {
+        ssize_t count = pread(fd, buffer, sizeof(buffer), offset);
+        if (count <= 0 || write(STDOUT_FILENO, buffer, count) != count)
+        {
+            return -1;
+        }
+        offset += count;
+    }
+    return 0;
+}
+
+static int write_all(int fd, const char* bytes, size_t length)
+{
+    ssize_t written;
+
+    while (length > 0)
+    {
+        written = write(fd, bytes, length);
+        if (written < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (written <= 0)
+        {
+            return -1;
+        }
+        bytes += written;
+        length -= written;
+    }
+    return 0;
+}
+
+/* send a segment count times to stdout */
+static int send_repeated(int fd, off_t size, unsigned long count)
+{
+    char* chunk;
+    size_t repeat;
+    size_t i;
+    unsigned long full;
+    int result = -1;
+
+    if (size == 0 || count == 0)
+    {
+        return 0;
+    }
+    if (size >= CACHE_CHUNK)
+    {
+        while (count-- > 0)
+        {
+            if (send_file(fd, size) != 0)
+            {
+                return -1;
+            }
+        }
+        return 0;
+    }
+
+    /* chunk of whole segments, count / repeat full chunks and the remainder */
+    repeat = (CACHE_CHUNK + size - 1) / size;
+    chunk = malloc(repeat * size);
+    if (chunk == NULL || pread(fd, chunk, size, 0) != size)
+    {
+        free(chunk);
+        return -1;
+    }
+    for (i = 1; i < repeat; i++)
+    {
+        memcpy(chunk + i * size, chunk, size);
+    }
+    for (full = count / repeat; full > 0; full--)
+    {
+        if (write_all(STDOUT_FILENO, chunk, repeat * size) != 0)
+        {
+            goto done;
+        }
+    }
+    if (write_all(STDOUT_FILENO, chunk, (count % repeat) * size) != 0)
+    {
+        goto done;
+    }
+    result = 0;
+
+done:
+    free(chunk);
+    return result;
+}
+
+static int serve_output(struct cache* const cache)
+{
+    char path[CACHE_PATH_MAX];
+    struct stat status;
+    int fd;
+
+    entry_path(cache, path, cache->key, "out");
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        return 0;
+    }
+    if (fstat(fd, &status) != 0)
+    {
+        close(fd);
+        return 0;
+    }
+
+    fflush(stdout);
+    send_file(fd, status.st_size);
+    close(fd);
+    utime(path, NULL);
+    return 1;
+}
+
+static int serve_recipe(struct cache* const cache)
+{
+    char path[CACHE_PATH_MAX];
+    const char instructions[] = "HQ9";
+    int fds[3] = { -1, -1, -1 };
+    off_t sizes[3] = { 0, 0, 0 };
+    struct stat status;
+    FILE *recipe;
+    char instruction;
+    unsigned long count;
+    int i;
+    int served = 0;
+
+    entry_path(cache, path, cache->key, "rcp");
+    recipe = fopen(path, "r");
+    if (recipe == NULL)
+    {
+        return 0;
+    }
+    utime(path, NULL);
+
+    /* open all segments before writing anything, so an evicted segment is still a miss */
+    for (i = 0; i < 3; i++)
+    {
+        segment_path(cache, path, instructions[i]);
+        fds[i] = open(path, O_RDONLY);
+        if (fds[i] >= 0 && fstat(fds[i], &status) == 0)
+        {
+            sizes[i] = status.st_size;
+            utime(path, NULL);
+        }
+    }
+    while (fscanf(recipe, " %c %lu", &instruction, &count) == 2)
+    {
+        if (instruction == '\0' || strchr(instructions, instruction) == NULL
+            || fds[strchr(instructions, instruction) - instructions] < 0)
+        {
+            goto done;
+        }
+    }
+
+    /* from here on the output is ours, a failing stdout would fail the engine as well */
+    served = 1;
+    fflush(stdout);
+    rewind(recipe);
+    while (fscanf(recipe, " %c %lu", &instruction, &count) == 2)
+    {
+        i = strchr(instructions, instruction) - instructions;
+        if (send_repeated(fds[i], sizes[i], count) != 0)
+        {
+            goto done;
+        }
+    }
+
+done:
+    for (i = 0; i < 3; i++)
+    {
+        if (fds[i] >= 0)
+        {
+            close(fds[i]);
+        }
+    }
+    fclose(recipe);
+    return served;
+}
+
+static int compare_modified(const void* a, const void* b)
+{
+    const struct cache_file* x = a;
+    const struct cache_file* y = b;
+    return (x->modified > y->modified) - (x->modified < y->modified);
+}
+
+/* remove least recently used files until the directory fits into its limit */
+static void evict(struct cache* const cache)
+{
+    DIR *directory;
+    struct dirent *entry;
+    struct stat status;
+    char path[CACHE_PATH_MAX];
+    struct cache_file *files = NULL;
+    size_t file_count = 0;
+    size_t capacity = 0;
+    unsigned long total = 0;
+    time_t now = time(NULL);
+    size_t i;
+
+    directory = opendir(cache->directory);
+    if (directory == NULL)
+    {
+        return;
+    }
+    while ((entry = readdir(directory)) != NULL)
+    {
+        if (strlen(entry->d_name) >= sizeof(files->name))
+        {
+            continue;
+        }
+        snprintf(path, CACHE_PATH_MAX, "%s/%s", cache->directory, entry->d_name);
+        if (stat(path, &status) != 0 || !S_ISREG(status.st_mode))
+        {
+            continue;
+        }
+        if (strstr(entry->d_name, ".tmp") != NULL)
+        {
+            /* in progress, or left behind by a process that died */
+            if (now - status.st_mtime > CACHE_STALE_SECONDS)
+            {
+                unlink(path);
+            }
+            continue;
+        }
+        if (file_count == capacity)
+        {
+            capacity = capacity == 0 ? 64 : capacity * 2;
+            files = realloc(files, capacity * sizeof(struct cache_file));
+            if (files == NULL)
+            {
+                closedir(directory);
+                return;
+            }
+        }
+        strcpy(files[file_count].name, entry->d_name);
+        files[file_count].size = status.st_size;
+        files[file_count].modified = status.st_mtime;
+        file_count++;
+        total += status.st_size;
+    }
+    closedir(directory);
+
+    if (total > cache->limit)
+    {
+        qsort(files, file_count, sizeof(struct cache_file), compare_modified);
+        for (i = 0; i < file_count && total > cache->limit; i++)
+        {
+            snprintf(path, CACHE_PATH_MAX, "%s/%s", cache->directory, files[i].name);
+            if (unlink(path) == 0)
+            {
+                total -= files[i].size;
+            }
+        }
+    }
+    free(files);
+}
+
+int cache_open(struct cache* const cache, const char* engine, char* filename, cache_emit_fn* emit)
+{
+    const char* directory;
+    const char* limit;
+    char* source;
+    size_t length;
+    size_t i;
+    size_t capacity = 0;
+    unsigned long engine_hash;
+
+    memset(cache, 0, sizeof(struct cache));
+    cache->saved_stdout = -1;
+
+    directory = getenv("HQ9_CACHE_DIR");
+    if (directory == NULL || *directory == '\0' || strlen(directory) > CACHE_PATH_MAX - 64)
+    {
+        return 0;
+    }
+    strcpy(cache->directory, directory);
+    limit = getenv("HQ9_CACHE_LIMIT");
+    cache->limit = limit != NULL ? strtoul(limit, NULL, 10) : CACHE_DEFAULT_LIMIT;
+
+    source = source_read(filename, &length, NULL, NULL);
+    if (source == NULL)
+    {
+        return 0;
+    }
+
+    /* key of the engine and key of engine + source */
+    engine_hash = hash_bytes(FNV_OFFSET_BASIS, engine, strlen(engine) + 1);
+    sprintf(cache->engine_key, "%016lx", engine_hash);
+    sprintf(cache->key, "%016lx", hash_bytes(engine_hash, source, length));
+
+    /* collapse the output producing instructions into runs */
+    for (i = 0; i < length; i++)
+    {
+        char instruction = source[i];
+        if (instruction != 'H' && instruction != 'Q' && instruction != '9')
+        {
+            continue;
+        }
+        if (cache->run_count > 0 && cache->runs[cache->run_count - 1].instruction == instruction)
+        {
+            cache->runs[cache->run_count - 1].count++;
+            continue;
+        }
+        if (cache->run_count == capacity)
+        {
+            capacity = capacity == 0 ? 16 : capacity * 2;
+            cache->runs = realloc(cache->runs, capacity * sizeof(struct cache_run));
+            if (cache->runs == NULL)
+            {
+                free(source);
+                return 0;
+            }
+        }
+        cache->runs[cache->run_count].instruction = instruction;
+        cache->runs[cache->run_count].count = 1;
+        cache->run_count++;
+    }
+    free(source);
+
+    cache->filename = filename;
+    cache->emit = emit;
+    cache->enabled = 1;
+    return 1;
+}
+
+int cache_serve(struct cache* const cache)
+{
+    if (!cache->enabled)
+    {
+        return 0;
+    }
+    return serve_output(cache) || serve_recipe(cache);
+}
+
+void cache_begin(struct cache* const cache)
+{
+    char path[CACHE_PATH_MAX];
+    char temporary[CACHE_PATH_MAX];
+    struct stat status;
+    unsigned long predicted = 0;
+    size_t i;
+    int saved;
+
+    if (!cache->enabled)
+    {
+        return;
+    }
+
+    /* render missing segments and predict the output size from them */
+    for (i = 0; i < cache->run_count; i++)
+    {
+        segment_path(cache, path, cache->runs[i].instruction);
+        if (stat(path, &status) != 0)
+        {
+            temporary_path(temporary, path);
+            saved = redirect_stdout(temporary);
+            if (saved < 0)
+            {
+                cache->enabled = 0;
+                return;
+            }
+            cache->emit(cache->runs[i].instruction, cache->filename);
+            restore_stdout(saved);
+            if (rename(temporary, path) != 0 || stat(path, &status) != 0)
+            {
+                unlink(temporary);
+                cache->enabled = 0;
+                return;
+            }
+        }
+        predicted += status.st_size * cache->runs[i].count;
+    }
+
+    if (predicted <= CACHE_RECIPE_THRESHOLD)
+    {
+        /* capture the complete output while it goes to stdout */
+        entry_path(cache, path, cache->key, "out");
+        temporary_path(cache->capture_path, path);
+        cache->saved_stdout = start_tee(cache);
+    }
+    else
+    {
+        /* written now, but only put in place by cache_end once the run has finished */
+        FILE *recipe;
+
+        entry_path(cache, path, cache->key, "rcp");
+        temporary_path(cache->capture_path, path);
+        recipe = fopen(cache->capture_path, "w");
+        if (recipe == NULL)
+        {
+            cache->capture_path[0] = '\0';
+            return;
+        }
+        for (i = 0; i < cache->run_count; i++)
+        {
+            fprintf(recipe, "%c %lu\n", cache->runs[i].instruction, cache->runs[i].count);
+        }
+        if (fclose(recipe) != 0)
+        {
+            unlink(cache->capture_path);
+            cache->capture_path[0] = '\0';
+        }
+    }
+}
+
+void cache_end(struct cache* const cache)
+{
+    char path[CACHE_PATH_MAX];
+    int status;
+
+    if (!cache->enabled)
+    {
+        return;
+    }
+
+    if (cache->saved_stdout >= 0)
+    {
+        /* closing the pipe ends the tee process, only a complete capture is kept */
+        restore_stdout(cache->saved_stdout);
+        cache->saved_stdout = -1;
+        entry_path(cache, path, cache->key, "out");
+        if (waitpid((pid_t) cache->tee_process, &status, 0) != cache->tee_process
+            || !WIFEXITED(status) || WEXITSTATUS(status) != 0
+            || rename(cache->capture_path, path) != 0)
+        {
+            unlink(cache->capture_path);
+        }
+    }
+    else if (cache->capture_path[0] != '\0')
+    {
+        /* the recipe is only valid if the whole output reached stdout */
+        entry_path(cache, path, cache->key, "rcp");
+        if (fflush(stdout) != 0 || ferror(stdout) || rename(cache->capture_path, path) != 0)
+        {
+            unlink(cache->capture_path);
+        }
+    }
+
+    evict(cache);
+    free(cache->runs);
+    cache->runs = NULL;
+    cache->enabled = 0;
+}
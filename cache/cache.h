@@ -0,0 +1,30 @@
+#define CACHE_PATH_MAX 4096
+
+/* renders the output of a single instruction ('H', 'Q' or '9') to stdout */
+typedef void cache_emit_fn (char instruction, char* filename);
+
+/* run of identical output producing instructions */
+struct cache_run {
+  char instruction;
+  unsigned long count;
+};
+
+struct cache {
+  int enabled;
+  char* filename;
+  cache_emit_fn* emit;
+  char directory[CACHE_PATH_MAX];
+  char key[17];
+  char engine_key[17];
+  unsigned long limit;
+  struct cache_run* runs;
+  size_t run_count;
+  int saved_stdout;
+  long tee_process;
+  char capture_path[CACHE_PATH_MAX];
+};
+
+int cache_open (struct cache* const cache, const char* engine, char* filename, cache_emit_fn* emit);
+int cache_serve (struct cache* const cache);
+void cache_begin (struct cache* const cache);
+void cache_end (struct cache* const cache);
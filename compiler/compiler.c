@@ -1,11 +1,15 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include "../grammar/grammar.h"
+#include "../source/source.h"
 
 /*
 !!! Work in Progress !!!
 
 Compiler for HQ9+ files (http://esolangs.org/wiki/HQ9)
-Outputs x86_64 assembly in AT&T syntax.
+Outputs x86_64 assembly in AT&T syntax, or with -c a C translation unit
+for the host compiler (optimiser, LTO, PGO, -march=native, other architectures).
 
 H: Print "hello, world"
 Q: Print the program's source code
@@ -13,7 +17,7 @@ Q: Print the program's source code
 +: Increment the accumulator
 
 Compile the compiler:
-    gcc -ansi -pedantic -Wall compiler.c -o HQ9+
+    gcc -ansi -pedantic -Wall compiler.c ../grammar/grammar.c ../source/source.c -o HQ9+
 
 Compile and assemble a HQ9+ program:
     long:
@@ -27,53 +31,90 @@ Start the program:
     ./program
 
 Fast testing:
-    gcc -ansi -pedantic -Wall compiler.c -o HQ9+ && ./HQ9+ ../main.hq9+ | gcc -no-pie -nostartfiles -o program -xassembler - && ./program
+    gcc -ansi -pedantic -Wall compiler.c ../grammar/grammar.c ../source/source.c -o HQ9+ && ./HQ9+ ../main.hq9+ | gcc -no-pie -nostartfiles -o program -xassembler - && ./program
+
+Compile a HQ9+ program via C:
+    ./HQ9+ -c ../main.hq9+ | gcc -O2 -march=native -o program -xc -
+
+Repeated instruction sequences are grammar compressed (../grammar/grammar.c):
+rules used more than once become subroutines, runs become counted loops, so
+the generated code grows with the information content of the program.
+Runs whose unrolled calls are no bigger than the loop overhead are unrolled.
+*/
+
+/*
+    Bytes of the x86_64 encoding: instructions and subroutines are calls, a loop is
+    subq/movabsq/movq (18) plus decq/jnz/addq (10). The assembler picks the short jnz
+    for the small bodies where unrolling is a close call.
 */
-void print_escaped_source_code(char* filename);
-void print_escaped_bottles_of_beer(int initial_bottle_count);
+static const struct grammar_sizes code_sizes = { 5, 5, 5, 28 };
+
+void compile_to_c(char* program, size_t length, size_t source_length);
+void print_symbol(struct grammar* grammar, int symbol);
+void print_rule(struct grammar* grammar, int symbol);
+void print_escaped_source_code(char* program, size_t length, unsigned long* column);
+void print_escaped_bottles_of_beer(int initial_bottle_count, unsigned long* column);
+void print_escaped_text(const char* text, size_t length, unsigned long* column);
 
 int main(int argc, char **argv)
 {
-    FILE *file;
-    char instruction;
     char* filename;
-
-    if(argc != 2)
+    char* program;
+    size_t length;
+    size_t source_length;
+    size_t i;
+    struct grammar grammar;
+    int c_backend = argc == 3 && strcmp(argv[1], "-c") == 0;
+
+    if(argc != 2 && !c_backend)
     {
         /* wrong number of args */
         fprintf(stderr, "Error: exactly 1 HQ9+ source file as arg required\n");
         exit(EXIT_FAILURE);
     }
 
-    /* open file */
-    filename = argv[1];
-    file = fopen(filename, "r");
-    if (file == NULL)
+    /* read file */
+    filename = argv[argc - 1];
+    program = source_read(filename, &length, NULL, NULL);
+    if (program == NULL)
     {
-        /* could not open file */
-        perror("Error opening file");
+        /* could not read file */
+        perror("Error reading file");
         exit(EXIT_FAILURE);
     }
 
+    /* the source is only embedded if Q prints it */
+    source_length = memchr(program, 'Q', length) != NULL ? length : 0;
+
+    if (c_backend)
+    {
+        compile_to_c(program, length, source_length);
+        free(program);
+        exit(EXIT_SUCCESS);
+    }
+
     /* data segment */
     fputs(
       ".data\n"
 
       "hello:\n"
-      "  .asciz \"hello world\\n\"\n"
+      "  .ascii \"hello, world\\n\"\n"
+      "hello_end:\n"
 
       "source:\n"
-      "  .asciz \""
+      "  .ascii \""
     , stdout);
-    print_escaped_source_code(filename);
+    print_escaped_source_code(program, source_length, NULL);
     puts("\"");
+    puts("source_end:");
 
     fputs(
       "bottles:\n"
-      "  .asciz \""
+      "  .ascii \""
     , stdout);
-    print_escaped_bottles_of_beer(99);
+    print_escaped_bottles_of_beer(99, NULL);
     puts("\"");
+    puts("bottles_end:");
 
     puts(
       "accumulator:\n"
@@ -86,31 +127,34 @@ int main(int argc, char **argv)
       ".globl _start\n"
 
       "H:\n"
-      /* call printf("hello world\n") */
-      /* don't use printf varargs -> store 0 as vararg length */
-      "  movb $0, %al\n"
+      /* call fwrite(hello, 1, hello_end - hello, stdout) */
       /* load effective address of string relativ to
          instruction pointer (%rip) as first argument (%rdi).
          Argument sequence for function calls:
          %rdi, %rsi, %rdx, %rcx, %r8, %r9 then on the stack in reverse order */
       "  leaq hello(%rip), %rdi\n"
-      "  call printf\n"
+      "  movq $1, %rsi\n"
+      "  movq $(hello_end - hello), %rdx\n"
+      "  movq stdout(%rip), %rcx\n"
+      "  call fwrite\n"
       "  ret\n"
 
+      /* the source may contain '%' or '\0', so it is written with its length
+         instead of being passed to printf as format string */
       "Q:\n"
-      "  movb $0, %al\n"
       "  leaq source(%rip), %rdi\n"
-      "  call printf\n"
+      "  movq $1, %rsi\n"
+      "  movq $(source_end - source), %rdx\n"
+      "  movq stdout(%rip), %rcx\n"
+      "  call fwrite\n"
       "  ret\n"
 
       "Nine:\n"
-      /* call printf("%d bottles of beer\n", accumulator) */
-      /* TODO assembly loop for whole song */
-      "  movb $1, %al\n"
       "  leaq bottles(%rip), %rdi\n"
-      /* accumulator as second argument for now*/
-      "  movq accumulator(%rip), %rsi\n"
-      "  call printf\n"
+      "  movq $1, %rsi\n"
+      "  movq $(bottles_end - bottles), %rdx\n"
+      "  movq stdout(%rip), %rcx\n"
+      "  call fwrite\n"
       "  ret\n"
 
       "Plus:\n"
@@ -135,85 +179,224 @@ int main(int argc, char **argv)
 
 
     /* parse file */
-    while((instruction = fgetc(file)) != EOF)
-    {
-        switch (instruction)
-        {
-            case 'H':
-                puts("  call H");
-                break;
-
-            case 'Q':
-                puts("  call Q");
-                break;
-
-            case '9':
-                puts("  call Nine");
-                break;
+    grammar_create(&grammar, program, length, NULL, NULL);
+    free(program);
 
-            case '+':
-                puts("  call Plus");
-                break;
-        }
-    }
-    if (!feof(file)) {
-        perror("Error reading file");
+    for (i = 0; i < grammar.length; i++)
+    {
+        print_symbol(&grammar, grammar.start[i]);
     }
-    fclose(file);
 
-    /* call exit(0) */
+    /* call exit(0), which unlike _exit flushes stdout */
     puts(
       "  movq $0, %rdi\n"
-      "  call _exit\n"
+      "  call exit\n"
     );
 
+    /* rules used more than once are subroutines,
+       entered with %rsp 16 Byte aligned like H, Q, Nine and Plus */
+    for (i = 0; i < grammar.rule_count; i++)
+    {
+        if (grammar.rules[i].uses >= 2)
+        {
+            printf("R%lu:\n  subq $8, %%rsp\n", (unsigned long) i);
+            print_rule(&grammar, GRAMMAR_RULES + (int) i);
+            puts("  addq $8, %rsp\n  ret");
+        }
+    }
+    grammar_destroy(&grammar);
+
     exit(EXIT_SUCCESS);
 }
 
 
-void print_escaped_source_code(char* filename)
+void print_symbol(struct grammar* grammar, int symbol)
 {
-    int c;
-    FILE *file;
+    /* call of an instruction or a subroutine, or the rule inline */
+    switch (symbol)
+    {
+        case 'H': puts("  call H"); return;
+        case 'Q': puts("  call Q"); return;
+        case '9': puts("  call Nine"); return;
+        case '+': puts("  call Plus"); return;
+    }
+    if (GRAMMAR_RULE(grammar, symbol)->uses >= 2)
+    {
+        printf("  call R%d\n", symbol - GRAMMAR_RULES);
+    }
+    else
+    {
+        print_rule(grammar, symbol);
+    }
+}
+
 
-    /* Open file again for second independent seek point indicator.
-       Read only -> No problem to have same file open multiple times. */
-    file = fopen(filename, "r");
-    if (file == NULL)
+void print_rule(struct grammar* grammar, int symbol)
+{
+    static unsigned long loop_count = 0;
+    unsigned long loop;
+    unsigned long i;
+    struct grammar_rule* rule = GRAMMAR_RULE(grammar, symbol);
+
+    if (rule->kind == GRAMMAR_PAIR)
     {
-        perror("Error opening file");
-        exit(EXIT_FAILURE);
+        print_symbol(grammar, rule->left);
+        print_symbol(grammar, rule->right);
+        return;
     }
 
-    /* Print source code */
-    while ((c = getc(file)) != EOF)
+    if (!grammar_is_loop(grammar, &code_sizes, rule))
     {
-        /* escape special characters */
-        switch (c)
+        for (i = 0; i < rule->count; i++)
         {
-            case '\a':  fputs("\\a", stdout); break;
-            case '\b':  fputs("\\b", stdout); break;
-            case '\f':  fputs("\\f", stdout); break;
-            case '\n':  fputs("\\n", stdout); break;
-            case '\r':  fputs("\\r", stdout); break;
-            case '\t':  fputs("\\t", stdout); break;
-            case '\v':  fputs("\\v", stdout); break;
-            case '\\':  fputs("\\\\", stdout); break;
-            case '\'':  fputs("\\'", stdout); break;
-            case '\"':  fputs("\\\"", stdout); break;
-            case '\?':  fputs("\\\?", stdout); break;
-            default:
-                putchar(c);
+            print_symbol(grammar, rule->left);
+        }
+        return;
+    }
+
+    /* counter on the stack, 16 Byte keep the alignment of the call sites */
+    loop = loop_count++;
+    printf(
+      "  subq $16, %%rsp\n"
+      "  movabsq $%lu, %%rax\n"
+      "  movq %%rax, (%%rsp)\n"
+      ".Lloop%lu:\n"
+    , rule->count, loop);
+    print_symbol(grammar, rule->left);
+    printf(
+      "  decq (%%rsp)\n"
+      "  jnz .Lloop%lu\n"
+      "  addq $16, %%rsp\n"
+    , loop);
+}
+
+
+void compile_to_c(char* program, size_t length, size_t source_length)
+{
+    /*
+        The program becomes constant tables and a small recursive walker:
+            rules:   the grammar, pairs and counted loops (see ../grammar/grammar.c)
+            program: top level symbols
+        Instructions are their characters, rule n is 256 + n. Tables instead of
+        a function per rule keep the host compiler from inlining the whole program.
+    */
+    struct grammar grammar;
+    struct grammar_rule* rule;
+    unsigned long column;
+    size_t i;
+
+    grammar_create(&grammar, program, length, NULL, NULL);
+
+    /* the texts are arrays, string literals are limited to 509 characters in C89 */
+    printf(
+      "/* generated by the HQ9+ compiler */\n"
+      "#include <stdio.h>\n"
+      "\n"
+      "static const char hello[] = \"hello, world\\n\";\n"
+      "static const unsigned char source[] = {\n"
+    );
+    column = 0;
+    print_escaped_source_code(program, source_length, &column);
+    fputs(
+      "0 };\n"
+      "static const unsigned char bottles[] = {\n"
+    , stdout);
+    column = 0;
+    print_escaped_bottles_of_beer(99, &column);
+    puts(
+      "0 };\n"
+      "static unsigned long accumulator;\n"
+      "\n"
+      "/* loop: left repeated count times, pair: left then right */\n"
+      "static const struct { int loop; int left; int right; unsigned long count; } rules[] = {"
+    );
+    for (i = 0; i < grammar.rule_count; i++)
+    {
+        rule = &grammar.rules[i];
+        printf("  { %d, %d, %d, %luUL },\n", rule->kind == GRAMMAR_LOOP, rule->left, rule->right, rule->count);
+    }
+
+    /* an empty initializer is not valid C, both tables end with an unused entry */
+    puts(
+      "  { 0, 0, 0, 0 }\n"
+      "};\n"
+      "\n"
+      "static const int program[] = {"
+    );
+    for (i = 0; i < grammar.length; i++)
+    {
+        printf("%d,", grammar.start[i]);
+        if ((i + 1) % 16 == 0)
+        {
+            putchar('\n');
         }
     }
+    printf(
+      "0\n"
+      "};\n"
+      "static const unsigned long program_length = %lu;\n"
+      "\n"
+    , (unsigned long) grammar.length);
+    fputs(
+      "static void run(int symbol)\n"
+      "{\n"
+      "  unsigned long i;\n"
+      "\n"
+      "  switch (symbol)\n"
+      "  {\n"
+      "    case 'H': fwrite(hello, 1, sizeof(hello) - 1, stdout); return;\n"
+      "    case 'Q': fwrite(source, 1, sizeof(source) - 1, stdout); return;\n"
+      "    case '9': fwrite(bottles, 1, sizeof(bottles) - 1, stdout); return;\n"
+      "    case '+': accumulator++; return;\n"
+      "  }\n"
+    , stdout);
+    printf(
+      "  symbol -= %d;\n"
+      "  if (rules[symbol].loop)\n"
+      "  {\n"
+      "    for (i = 0; i < rules[symbol].count; i++)\n"
+      "    {\n"
+      "      run(rules[symbol].left);\n"
+      "    }\n"
+      "  }\n"
+      "  else\n"
+      "  {\n"
+      "    run(rules[symbol].left);\n"
+      "    run(rules[symbol].right);\n"
+      "  }\n"
+      "}\n"
+      "\n"
+    , GRAMMAR_RULES);
+    puts(
+      "int main(void)\n"
+      "{\n"
+      "  static char buffer[1 << 16];\n"
+      "  unsigned long i;\n"
+      "\n"
+      "  setvbuf(stdout, buffer, _IOFBF, sizeof(buffer));\n"
+      "  for (i = 0; i < program_length; i++)\n"
+      "  {\n"
+      "    run(program[i]);\n"
+      "  }\n"
+      "  if (fflush(stdout) != 0 || ferror(stdout))\n"
+      "  {\n"
+      "    return 1;\n"
+      "  }\n"
+      "  return 0;\n"
+      "}"
+    );
+    grammar_destroy(&grammar);
+}
+
 
-    /* Close second file descriptor */
-    fclose(file);
+void print_escaped_source_code(char* program, size_t length, unsigned long* column)
+{
+    print_escaped_text(program, length, column);
 }
 
-void print_escaped_bottles_of_beer(int initial_bottle_count)
+void print_escaped_bottles_of_beer(int initial_bottle_count, unsigned long* column)
 {
-    /* TODO only text required for assembly loop */
+    char line[256];
     int bottle_count;
     char* pluralized_bottle;
 
@@ -222,24 +405,62 @@ void print_escaped_bottles_of_beer(int initial_bottle_count)
         if (bottle_count > 0)
         {
             pluralized_bottle = bottle_count == 1 ? "bottle" : "bottles";
-            printf("%d %s of beer on the wall, %d %s of beer.\\n" \
+            sprintf(line, "%d %s of beer on the wall, %d %s of beer.\n" \
                      "Take one down and pass it around, ", bottle_count, pluralized_bottle, bottle_count, pluralized_bottle);
+            print_escaped_text(line, strlen(line), column);
             if (bottle_count == 1)
             {
-                printf("no more bottles of beer on the wall.\\n");
+                sprintf(line, "no more bottles of beer on the wall.\n");
             }
             else
             {
                 pluralized_bottle = bottle_count-1 == 1 ? "bottle" : "bottles";
-                printf("%d %s of beer on the wall.\\n", bottle_count-1, pluralized_bottle);
+                sprintf(line, "%d %s of beer on the wall.\n", bottle_count-1, pluralized_bottle);
             }
         }
         else
         {
             pluralized_bottle = initial_bottle_count == 1 ? "bottle" : "bottles";
-            printf("No more bottles of beer on the wall, no more bottles of beer.\\n" \
+            sprintf(line, "No more bottles of beer on the wall, no more bottles of beer.\n" \
             "Go to the store and buy some more, " \
-            "%d %s of beer on the wall.\\n", initial_bottle_count, pluralized_bottle);
+            "%d %s of beer on the wall.\n", initial_bottle_count, pluralized_bottle);
+        }
+        print_escaped_text(line, strlen(line), column);
+    }
+}
+
+void print_escaped_text(const char* text, size_t length, unsigned long* column)
+{
+    /* with column: C array initializer, 16 bytes per line over all calls for one array */
+    int c;
+    size_t i;
+
+    for (i = 0; i < length; i++)
+    {
+        c = (unsigned char) text[i];
+        if (column != NULL)
+        {
+            printf("%d,", c);
+            if (++*column % 16 == 0)
+            {
+                putchar('\n');
+            }
+            continue;
+        }
+        /* assembler string: escape special characters, everything unprintable as octal (e.g. '\0') */
+        switch (c)
+        {
+            case '\\':  fputs("\\\\", stdout); break;
+            case '\"':  fputs("\\\"", stdout); break;
+            default:
+                if (c >= ' ' && c <= '~')
+                {
+                    putchar(c);
+                }
+                else
+                {
+                    printf("\\%03o", c);
+                }
         }
     }
 }
@@ -0,0 +1,72 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "lz.h"
+#include "../source/source.h"
+
+/*
+Compressor and decompressor for HQ9+ output (see lz.c for the format).
+
+The interpreter and the jit compiler write compressed output themselves (-z),
+this tool compresses the output of any other source, e.g. a compiled program.
+
+Compile:
+    gcc -ansi -pedantic -Wall hq9z.c lz.c ../source/source.c -o hq9z
+
+Compress the output of a program:
+    ./program | ./hq9z ../main.hq9+ > output.hq9z
+
+Decompress:
+    ./hq9z -d < output.hq9z
+*/
+
+#define CHUNK_SIZE (1024 * 1024)
+
+int main(int argc, char **argv)
+{
+    struct lz_writer writer;
+    char* source;
+    char* buffer;
+    size_t source_length;
+    size_t length;
+
+    if (argc == 2 && strcmp(argv[1], "-d") == 0)
+    {
+        exit(lz_decode(stdin, stdout) == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+    if (argc != 2)
+    {
+        fprintf(stderr, "Usage: %s <HQ9+ source file> < output > compressed\n" \
+                        "       %s -d < compressed > output\n", argv[0], argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    source = source_read(argv[1], &source_length, NULL, NULL);
+    if (source == NULL)
+    {
+        perror("Could not read file into buffer");
+        exit(EXIT_FAILURE);
+    }
+    lz_writer_create(&writer, stdout, source, source_length);
+    free(source);
+
+    /* stream stdin through the encoder chunk by chunk */
+    buffer = malloc(CHUNK_SIZE);
+    if (buffer == NULL)
+    {
+        perror("Error allocating buffer");
+        exit(EXIT_FAILURE);
+    }
+    while ((length = fread(buffer, 1, CHUNK_SIZE, stdin)) > 0)
+    {
+        lz_write(&writer, buffer, length);
+    }
+    free(buffer);
+    if (lz_writer_destroy(&writer) != 0)
+    {
+        perror("Error writing output");
+        exit(EXIT_FAILURE);
+    }
+
+    exit(EXIT_SUCCESS);
+}
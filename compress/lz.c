@@ -0,0 +1,354 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "lz.h"
+
+/*
+Streaming LZ-style compression of HQ9+ output, without external libraries.
+
+HQ9+ output only consists of three texts, so the dictionary is preloaded with
+all of them and every instruction becomes a single back-reference into it:
+    dictionary = "hello, world\n" + lyrics + program source
+
+Stream format (varints are unsigned LEB128):
+    "HQ9Z" <version byte> <varint source length> <source bytes>
+    (the source is only sent if it contains 'Q', otherwise its length is 0)
+    tokens until end of file:
+        0x00 <varint length> <bytes>                        literal
+        0x01 <varint offset> <varint length> <varint count> copy dictionary[offset, offset + length) count times
+
+Consecutive identical copies are merged into one token, so runs of instructions
+cost no more than a single one.
+*/
+
+#define LZ_LITERAL 0x00
+#define LZ_COPY 0x01
+
+/* lz_write: matches are searched via a hash table of 4 byte prefixes */
+#define LZ_HASH_BITS 16
+#define LZ_MIN_MATCH 8
+
+static void put_varint(FILE* out, unsigned long value)
+{
+    while (value >= 0x80)
+    {
+        putc((int) (value & 0x7F) | 0x80, out);
+        value >>= 7;
+    }
+    putc((int) value, out);
+}
+
+static int get_varint(FILE* in, unsigned long* value)
+{
+    int c;
+    int shift = 0;
+
+    *value = 0;
+    do
+    {
+        c = getc(in);
+        if (c == EOF || shift > 63)
+        {
+            return -1;
+        }
+        *value |= (unsigned long) (c & 0x7F) << shift;
+        shift += 7;
+    } while (c & 0x80);
+    return 0;
+}
+
+static void append(struct lz_dictionary* const dictionary, size_t* capacity, const char* bytes, size_t length)
+{
+    while (dictionary->size + length > *capacity)
+    {
+        *capacity = *capacity == 0 ? 16384 : *capacity * 2;
+        dictionary->data = realloc(dictionary->data, *capacity);
+        if (dictionary->data == NULL)
+        {
+            perror("Error allocating dictionary");
+            exit(EXIT_FAILURE);
+        }
+    }
+    memcpy(dictionary->data + dictionary->size, bytes, length);
+    dictionary->size += length;
+}
+
+void lz_dictionary_create(struct lz_dictionary* const dictionary, const char* source, size_t source_length)
+{
+    char line_buffer[256];
+    char* pluralized_bottle;
+    int bottle_count;
+    int initial_bottle_count = 99;
+    size_t capacity = 0;
+
+    dictionary->data = NULL;
+    dictionary->size = 0;
+
+    /* hello world */
+    dictionary->offsets[LZ_HELLO] = dictionary->size;
+    append(dictionary, &capacity, "hello, world\n", 13);
+    dictionary->lengths[LZ_HELLO] = dictionary->size - dictionary->offsets[LZ_HELLO];
+
+    /* lyrics, same text as the engines print */
+    dictionary->offsets[LZ_LYRICS] = dictionary->size;
+    for (bottle_count = initial_bottle_count; bottle_count >= 0; bottle_count--)
+    {
+        if (bottle_count > 0)
+        {
+            pluralized_bottle = bottle_count == 1 ? "bottle" : "bottles";
+            sprintf(line_buffer, "%d %s of beer on the wall, %d %s of beer.\n" \
+                     "Take one down and pass it around, ", bottle_count, pluralized_bottle, bottle_count, pluralized_bottle);
+            append(dictionary, &capacity, line_buffer, strlen(line_buffer));
+            if (bottle_count == 1)
+            {
+                sprintf(line_buffer, "no more bottles of beer on the wall.\n");
+            }
+            else
+            {
+                pluralized_bottle = bottle_count-1 == 1 ? "bottle" : "bottles";
+                sprintf(line_buffer, "%d %s of beer on the wall.\n", bottle_count-1, pluralized_bottle);
+            }
+            append(dictionary, &capacity, line_buffer, strlen(line_buffer));
+        }
+        else
+        {
+            pluralized_bottle = initial_bottle_count == 1 ? "bottle" : "bottles";
+            sprintf(line_buffer, "No more bottles of beer on the wall, no more bottles of beer.\n" \
+            "Go to the store and buy some more, " \
+            "%d %s of beer on the wall.\n", initial_bottle_count, pluralized_bottle);
+            append(dictionary, &capacity, line_buffer, strlen(line_buffer));
+        }
+    }
+    dictionary->lengths[LZ_LYRICS] = dictionary->size - dictionary->offsets[LZ_LYRICS];
+
+    /* program source */
+    dictionary->offsets[LZ_SOURCE] = dictionary->size;
+    append(dictionary, &capacity, source, source_length);
+    dictionary->lengths[LZ_SOURCE] = source_length;
+}
+
+void lz_dictionary_destroy(struct lz_dictionary* dictionary)
+{
+    free(dictionary->data);
+    dictionary->data = NULL;
+}
+
+static void flush_pending(struct lz_writer* const writer)
+{
+    if (writer->pending)
+    {
+        putc(LZ_COPY, writer->out);
+        put_varint(writer->out, writer->pending_offset);
+        put_varint(writer->out, writer->pending_length);
+        put_varint(writer->out, writer->pending_count);
+        writer->pending = 0;
+    }
+}
+
+static void write_literal(struct lz_writer* const writer, const char* bytes, size_t length)
+{
+    if (length == 0)
+    {
+        return;
+    }
+    flush_pending(writer);
+    putc(LZ_LITERAL, writer->out);
+    put_varint(writer->out, length);
+    fwrite(bytes, 1, length, writer->out);
+}
+
+void lz_writer_create(struct lz_writer* const writer, FILE* out, const char* source, size_t source_length)
+{
+    /* without Q the output never contains the source, no need to ship it */
+    if (memchr(source, 'Q', source_length) == NULL)
+    {
+        source_length = 0;
+    }
+    writer->out = out;
+    writer->table = NULL;
+    writer->pending = 0;
+    lz_dictionary_create(&writer->dictionary, source, source_length);
+
+    /* header, the decoder rebuilds the dictionary from the source */
+    fputs(LZ_MAGIC, out);
+    putc(LZ_VERSION, out);
+    put_varint(out, source_length);
+    fwrite(source, 1, source_length, out);
+}
+
+int lz_writer_destroy(struct lz_writer* writer)
+{
+    /* returns -1 if the stream could not be written completely */
+    int result;
+
+    flush_pending(writer);
+    result = fflush(writer->out) != 0 || ferror(writer->out) ? -1 : 0;
+    lz_dictionary_destroy(&writer->dictionary);
+    free(writer->table);
+    writer->table = NULL;
+    return result;
+}
+
+void lz_copy(struct lz_writer* const writer, size_t offset, size_t length)
+{
+    if (length == 0)
+    {
+        return;
+    }
+    if (writer->pending && writer->pending_offset == offset && writer->pending_length == length)
+    {
+        writer->pending_count++;
+        return;
+    }
+    flush_pending(writer);
+    writer->pending = 1;
+    writer->pending_offset = offset;
+    writer->pending_length = length;
+    writer->pending_count = 1;
+}
+
+void lz_reference(struct lz_writer* const writer, enum lz_segment segment)
+{
+    lz_copy(writer, writer->dictionary.offsets[segment], writer->dictionary.lengths[segment]);
+}
+
+static size_t hash4(const char* bytes)
+{
+    unsigned long value = (unsigned char) bytes[0] | (unsigned char) bytes[1] << 8
+        | (unsigned long) (unsigned char) bytes[2] << 16 | (unsigned long) (unsigned char) bytes[3] << 24;
+    return (value * 2654435761UL) >> (32 - LZ_HASH_BITS) & ((1 << LZ_HASH_BITS) - 1);
+}
+
+void lz_write(struct lz_writer* const writer, const char* bytes, size_t length)
+{
+    /* greedy matching of arbitrary bytes against the dictionary */
+    const char* dictionary = writer->dictionary.data;
+    size_t size = writer->dictionary.size;
+    size_t literal_start = 0;
+    size_t position = 0;
+    size_t i;
+
+    if (writer->table == NULL)
+    {
+        writer->table = calloc((size_t) 1 << LZ_HASH_BITS, sizeof(size_t));
+        if (writer->table == NULL)
+        {
+            perror("Error allocating hash table");
+            exit(EXIT_FAILURE);
+        }
+        /* first occurrence wins, so repeated texts map to the same offsets */
+        for (i = size >= 4 ? size - 4 + 1 : 0; i-- > 0;)
+        {
+            writer->table[hash4(dictionary + i)] = i + 1;
+        }
+    }
+
+    while (position + 4 <= length)
+    {
+        size_t candidate = writer->table[hash4(bytes + position)];
+        size_t match = 0;
+
+        if (candidate != 0)
+        {
+            candidate--;
+            while (position + match < length && candidate + match < size
+                   && bytes[position + match] == dictionary[candidate + match])
+            {
+                match++;
+            }
+        }
+
+        if (match >= LZ_MIN_MATCH)
+        {
+            write_literal(writer, bytes + literal_start, position - literal_start);
+            lz_copy(writer, candidate, match);
+            position += match;
+            literal_start = position;
+        }
+        else
+        {
+            position++;
+        }
+    }
+    write_literal(writer, bytes + literal_start, length - literal_start);
+}
+
+int lz_decode(FILE* in, FILE* out)
+{
+    struct lz_dictionary dictionary;
+    char magic[sizeof(LZ_MAGIC)];
+    char buffer[65536];
+    unsigned long source_length;
+    unsigned long offset, length, count;
+    char* source;
+    int token;
+
+    /* header */
+    if (fread(magic, 1, sizeof(LZ_MAGIC) - 1, in) != sizeof(LZ_MAGIC) - 1
+        || memcmp(magic, LZ_MAGIC, sizeof(LZ_MAGIC) - 1) != 0
+        || getc(in) != LZ_VERSION || get_varint(in, &source_length) != 0)
+    {
+        fprintf(stderr, "Error: not a HQ9Z stream\n");
+        return -1;
+    }
+    source = malloc(source_length + 1);
+    if (source == NULL || fread(source, 1, source_length, in) != source_length)
+    {
+        free(source);
+        fprintf(stderr, "Error: truncated HQ9Z stream\n");
+        return -1;
+    }
+    lz_dictionary_create(&dictionary, source, source_length);
+    free(source);
+
+    /* tokens */
+    while ((token = getc(in)) != EOF)
+    {
+        switch (token)
+        {
+            case LZ_LITERAL:
+                if (get_varint(in, &length) != 0)
+                {
+                    goto corrupt;
+                }
+                while (length > 0)
+                {
+                    size_t chunk = length < sizeof(buffer) ? length : sizeof(buffer);
+                    if (fread(buffer, 1, chunk, in) != chunk)
+                    {
+                        goto corrupt;
+                    }
+                    fwrite(buffer, 1, chunk, out);
+                    length -= chunk;
+                }
+                break;
+
+            case LZ_COPY:
+                if (get_varint(in, &offset) != 0 || get_varint(in, &length) != 0 || get_varint(in, &count) != 0
+                    || offset > dictionary.size || length > dictionary.size - offset)
+                {
+                    goto corrupt;
+                }
+                while (count-- > 0 && !ferror(out))
+                {
+                    fwrite(dictionary.data + offset, 1, length, out);
+                }
+                break;
+
+            default:
+                goto corrupt;
+        }
+    }
+    lz_dictionary_destroy(&dictionary);
+    if (fflush(out) != 0 || ferror(out))
+    {
+        perror("Error writing output");
+        return -1;
+    }
+    return 0;
+
+corrupt:
+    fprintf(stderr, "Error: corrupt HQ9Z stream\n");
+    lz_dictionary_destroy(&dictionary);
+    return -1;
+}
@@ -0,0 +1,38 @@
+#define LZ_MAGIC "HQ9Z"
+#define LZ_VERSION 1
+
+/* segments of the preloaded dictionary, in this order */
+enum lz_segment {
+  LZ_HELLO,
+  LZ_LYRICS,
+  LZ_SOURCE,
+  LZ_SEGMENT_COUNT
+};
+
+struct lz_dictionary {
+  char* data;
+  size_t size;
+  size_t offsets[LZ_SEGMENT_COUNT];
+  size_t lengths[LZ_SEGMENT_COUNT];
+};
+
+struct lz_writer {
+  FILE* out;
+  struct lz_dictionary dictionary;
+  size_t* table;
+  int pending;
+  size_t pending_offset;
+  size_t pending_length;
+  unsigned long pending_count;
+};
+
+void lz_dictionary_create (struct lz_dictionary* const dictionary, const char* source, size_t source_length);
+void lz_dictionary_destroy (struct lz_dictionary* dictionary);
+
+void lz_writer_create (struct lz_writer* const writer, FILE* out, const char* source, size_t source_length);
+int lz_writer_destroy (struct lz_writer* writer);
+void lz_reference (struct lz_writer* const writer, enum lz_segment segment);
+void lz_copy (struct lz_writer* const writer, size_t offset, size_t length);
+void lz_write (struct lz_writer* const writer, const char* bytes, size_t length);
+
+int lz_decode (FILE* in, FILE* out);
@@ -0,0 +1,526 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "../process/process.h"
+
+/*
+Differential conformance and performance regression gate for the HQ9+ engines.
+
+Generates adversarial and random HQ9+ programs, runs them through the interpreter,
+the compiler (+ gcc, for both the assembly and the C backend) and the jit compiler
+and checks that all outputs are byte-identical. The interpreter and the jit compiler
+also run through a private output cache (see cache/cache.c), once filling it and
+once replaying it; both outputs have to match. Their compressed output (-z)
+has to round-trip through hq9z -d (see compress/lz.c) to the same bytes. An inherited HQ9_CACHE_DIR is
+cleared, so all other engines really run.
+Afterwards the throughput (output bytes per second, including compilation) of every
+engine is measured on a fixed workload and compared against a stored baseline.
+
+Compile the engines as described in their sources, then compile the gate:
+    gcc -ansi -pedantic -Wall conformance.c ../process/process.c -o conformance
+
+Record a baseline:
+    ./conformance -w -b baseline.txt
+
+Check conformance and fail on throughput regressions of more than 10%:
+    ./conformance -b baseline.txt -t 10
+
+Options:
+    -n <count>      number of random programs (default 20)
+    -s <seed>       seed of the random programs (default 1)
+    -b <file>       throughput baseline, must exist unless -w is given
+    -w              write the measured throughput to the baseline instead of comparing
+    -t <percent>    allowed throughput regression (default 10)
+    -i/-c/-j <path> interpreter, compiler and jit compiler (default ../<engine>/HQ9+)
+    -z <path>       decompressor (default ../compress/hq9z)
+    -k              keep the generated programs and outputs
+
+Exits with a failure if any output differs or any engine regressed.
+*/
+
+#define ENGINE_COUNT 8
+#define REPETITIONS 3
+
+struct engine {
+  const char* name;
+  char* path;
+  int (*run) (struct engine* engine, const char* program, const char* output);
+  double throughput;
+  double baseline;
+};
+
+int run_interpreted(struct engine* engine, const char* program, const char* output);
+int run_compiled(struct engine* engine, const char* program, const char* output);
+int run_compiled_c(struct engine* engine, const char* program, const char* output);
+int run_cached(struct engine* engine, const char* program, const char* output);
+int run_compressed(struct engine* engine, const char* program, const char* output);
+int compare_outputs(const char* expected, const char* actual, long* difference);
+long file_size(const char* filename);
+void write_program(const char* filename, const char* code, size_t length);
+char* random_program(size_t* length);
+int check_program(struct engine* engines, const char* name, const char* code, size_t length);
+int measure_throughput(struct engine* engine);
+void read_baseline(struct engine* engines, const char* filename);
+void write_baseline(struct engine* engines, const char* filename);
+
+char work_directory[] = "/tmp/hq9-conformance-XXXXXX";
+char cache_directory[64];
+char* decompressor = "../compress/hq9z";
+unsigned long random_state;
+int programs_checked;
+
+int main(int argc, char **argv)
+{
+    struct engine engines[ENGINE_COUNT] = {
+        { "interpreter", "../interpreter/HQ9+", run_interpreted, 0, 0 },
+        { "compiler", "../compiler/HQ9+", run_compiled, 0, 0 },
+        { "jit", "../jit/HQ9+", run_interpreted, 0, 0 },
+        { "compiler-c", "../compiler/HQ9+", run_compiled_c, 0, 0 },
+        { "interpreter-cached", "../interpreter/HQ9+", run_cached, 0, 0 },
+        { "jit-cached", "../jit/HQ9+", run_cached, 0, 0 },
+        { "interpreter-z", "../interpreter/HQ9+", run_compressed, 0, 0 },
+        { "jit-z", "../jit/HQ9+", run_compressed, 0, 0 }
+    };
+    int program_count = 20;
+    double threshold = 10;
+    char* baseline = NULL;
+    int write = 0;
+    int keep = 0;
+    int failures = 0;
+    int option;
+    int i;
+    char name[64];
+    char* code;
+    size_t length;
+
+    random_state = 1;
+    while ((option = getopt(argc, argv, "n:s:b:wt:i:c:j:z:k")) != -1)
+    {
+        switch (option)
+        {
+            case 'n': program_count = atoi(optarg); break;
+            case 's': random_state = strtoul(optarg, NULL, 10); break;
+            case 'b': baseline = optarg; break;
+            case 'w': write = 1; break;
+            case 't': threshold = atof(optarg); break;
+            case 'i': engines[0].path = optarg; engines[4].path = optarg; engines[6].path = optarg; break;
+            case 'c': engines[1].path = optarg; engines[3].path = optarg; break;
+            case 'j': engines[2].path = optarg; engines[5].path = optarg; engines[7].path = optarg; break;
+            case 'z': decompressor = optarg; break;
+            case 'k': keep = 1; break;
+            default:
+                fprintf(stderr, "Usage: %s [-n count] [-s seed] [-b baseline] [-w] [-t percent] "
+                                "[-i interpreter] [-c compiler] [-j jit] [-z hq9z] [-k]\n", argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    /* a missing baseline must not silently turn the gate off */
+    if (baseline != NULL && !write)
+    {
+        read_baseline(engines, baseline);
+    }
+
+    /* only the cached engines may use a cache, and only their own */
+    unsetenv("HQ9_CACHE_DIR");
+    if (mkdtemp(work_directory) == NULL)
+    {
+        perror("Error creating work directory");
+        exit(EXIT_FAILURE);
+    }
+    sprintf(cache_directory, "%s/cache", work_directory);
+    if (mkdir(cache_directory, 0755) != 0)
+    {
+        perror("Error creating cache directory");
+        exit(EXIT_FAILURE);
+    }
+
+    /*** conformance ***/
+    {
+        /* adversarial programs */
+        char format[] = "Q%s%n%d%%";
+        char nul[] = "Q\0H\0Q";
+        char high[] = "\377HQ\377\200";
+        char escapes[] = "Q\"\\\a\b\f\n\r\t\v'?hq9+ ";
+        char all_bytes[257];
+
+        for (i = 0; i < 256; i++)
+        {
+            all_bytes[i] = (char) i;
+        }
+        all_bytes[256] = 'Q';
+
+        failures += check_program(engines, "empty", "", 0);
+        failures += check_program(engines, "format", format, sizeof(format) - 1);
+        failures += check_program(engines, "nul", nul, sizeof(nul) - 1);
+        failures += check_program(engines, "high", high, sizeof(high) - 1);
+        failures += check_program(engines, "escapes", escapes, sizeof(escapes) - 1);
+        failures += check_program(engines, "all_bytes", all_bytes, sizeof(all_bytes));
+
+        /* huge runs */
+        code = malloc(100000);
+        memset(code, 'H', 100000);
+        failures += check_program(engines, "run_hello", code, 100000);
+        memset(code, '+', 100000);
+        failures += check_program(engines, "run_plus", code, 100000);
+        memset(code, '9', 200);
+        failures += check_program(engines, "run_nine", code, 200);
+        memset(code, 'Q', 2000);
+        failures += check_program(engines, "run_source", code, 2000);
+        free(code);
+    }
+
+    for (i = 0; i < program_count; i++)
+    {
+        sprintf(name, "random%d", i);
+        code = random_program(&length);
+        failures += check_program(engines, name, code, length);
+        free(code);
+    }
+
+    printf("conformance: %d programs, %d mismatches\n", programs_checked, failures);
+
+    /*** throughput ***/
+    printf("throughput (MB/s):\n");
+    for (i = 0; i < ENGINE_COUNT; i++)
+    {
+        if (measure_throughput(&engines[i]) != 0)
+        {
+            failures++;
+            continue;
+        }
+        printf("  %-18s %10.2f", engines[i].name, engines[i].throughput / 1e6);
+        if (engines[i].baseline > 0)
+        {
+            double change = (engines[i].throughput / engines[i].baseline - 1) * 100;
+            printf("  (baseline %.2f, %+.1f%%)", engines[i].baseline / 1e6, change);
+            if (change < -threshold)
+            {
+                printf("  REGRESSION");
+                failures++;
+            }
+        }
+        printf("\n");
+    }
+    if (baseline != NULL && write)
+    {
+        write_baseline(engines, baseline);
+    }
+
+    /* keep the files of failing runs for inspection */
+    if (failures == 0 && !keep)
+    {
+        char* argv_rm[] = { "rm", "-rf", work_directory, NULL };
+        process_execute(argv_rm, NULL, NULL);
+    }
+    else
+    {
+        printf("programs and outputs kept in %s\n", work_directory);
+    }
+
+    exit(failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+int check_program(struct engine* engines, const char* name, const char* code, size_t length)
+{
+    char program[128];
+    char expected[128];
+    char actual[128];
+    long difference;
+    int mismatches = 0;
+    int i;
+
+    sprintf(program, "%s/%s.hq9", work_directory, name);
+    write_program(program, code, length);
+    programs_checked++;
+
+    /* the first engine is the reference */
+    sprintf(expected, "%s/%s.%s.out", work_directory, name, engines[0].name);
+    if (engines[0].run(&engines[0], program, expected) != 0)
+    {
+        printf("FAIL %s: %s did not run\n", name, engines[0].name);
+        return 1;
+    }
+
+    for (i = 1; i < ENGINE_COUNT; i++)
+    {
+        sprintf(actual, "%s/%s.%s.out", work_directory, name, engines[i].name);
+        if (engines[i].run(&engines[i], program, actual) != 0)
+        {
+            printf("FAIL %s: %s did not run\n", name, engines[i].name);
+            mismatches = 1;
+        }
+        else if (compare_outputs(expected, actual, &difference) != 0)
+        {
+            printf("FAIL %s: %s differs from %s at byte %ld\n", name, engines[i].name, engines[0].name, difference);
+            mismatches = 1;
+        }
+    }
+    return mismatches;
+}
+
+int measure_throughput(struct engine* engine)
+{
+    /* fixed workload: short and long outputs, many instructions and a mixed program */
+    const char* workload[] = { "hello", "source", "nine", "mixed" };
+    char program[128];
+    char output[128];
+    struct timespec start, end;
+    double seconds;
+    double best = 0;
+    long bytes = 0;
+    size_t length;
+    char* code;
+    int i, repetition;
+
+    for (i = 0; i < 4; i++)
+    {
+        switch (i)
+        {
+            case 0: length = 20000; code = malloc(length); memset(code, 'H', length); break;
+            case 1: length = 1000; code = malloc(length); memset(code, 'Q', length); break;
+            case 2: length = 100; code = malloc(length); memset(code, '9', length); break;
+            default:
+                length = 20000;
+                code = malloc(length);
+                for (repetition = 0; repetition < (int) length; repetition++)
+                {
+                    code[repetition] = "HQ9+"[repetition * 7 % 13 % 4];
+                }
+        }
+        sprintf(program, "%s/bench_%s.hq9", work_directory, workload[i]);
+        write_program(program, code, length);
+        free(code);
+    }
+
+    for (repetition = 0; repetition < REPETITIONS; repetition++)
+    {
+        bytes = 0;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (i = 0; i < 4; i++)
+        {
+            sprintf(program, "%s/bench_%s.hq9", work_directory, workload[i]);
+            sprintf(output, "%s/bench_%s.%s.out", work_directory, workload[i], engine->name);
+            if (engine->run(engine, program, output) != 0)
+            {
+                printf("FAIL throughput: %s did not run\n", engine->name);
+                return -1;
+            }
+            bytes += file_size(output);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        /* best of all repetitions, to reduce noise */
+        seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+        if (bytes / seconds > best)
+        {
+            best = bytes / seconds;
+        }
+    }
+    engine->throughput = best;
+    return 0;
+}
+
+int run_interpreted(struct engine* engine, const char* program, const char* output)
+{
+    return process_run(engine->path, program, output);
+}
+
+int run_compiled(struct engine* engine, const char* program, const char* output)
+{
+    /* build files next to the program in the work directory */
+    return process_run_compiled(engine->path, program, program, output);
+}
+
+int run_compiled_c(struct engine* engine, const char* program, const char* output)
+{
+    return process_run_compiled_c(engine->path, program, program, output);
+}
+
+int run_cached(struct engine* engine, const char* program, const char* output)
+{
+    /* the first run may fill the cache, the second has to be a hit with the same output */
+    char filled[160];
+    long difference;
+    int status;
+
+    sprintf(filled, "%s.fill", output);
+    setenv("HQ9_CACHE_DIR", cache_directory, 1);
+    status = run_interpreted(engine, program, filled);
+    if (status == 0)
+    {
+        status = run_interpreted(engine, program, output);
+    }
+    unsetenv("HQ9_CACHE_DIR");
+
+    if (status == 0 && compare_outputs(filled, output, &difference) != 0)
+    {
+        printf("FAIL %s: %s replay differs from its first run at byte %ld\n", program, engine->name, difference);
+        return -1;
+    }
+    return status;
+}
+
+int run_compressed(struct engine* engine, const char* program, const char* output)
+{
+    char compressed[160];
+    char* argv_compress[4];
+    char* argv_decompress[3];
+
+    sprintf(compressed, "%s.z", output);
+    argv_compress[0] = engine->path;
+    argv_compress[1] = "-z";
+    argv_compress[2] = (char*) program;
+    argv_compress[3] = NULL;
+    argv_decompress[0] = decompressor;
+    argv_decompress[1] = "-d";
+    argv_decompress[2] = NULL;
+
+    if (process_execute(argv_compress, NULL, compressed) != 0)
+    {
+        return -1;
+    }
+    return process_execute(argv_decompress, compressed, output);
+}
+
+int compare_outputs(const char* expected, const char* actual, long* difference)
+{
+    FILE *a, *b;
+    int x, y;
+    long position = 0;
+
+    a = fopen(expected, "rb");
+    b = fopen(actual, "rb");
+    if (a == NULL || b == NULL)
+    {
+        perror("Error opening output");
+        exit(EXIT_FAILURE);
+    }
+
+    do
+    {
+        x = getc(a);
+        y = getc(b);
+        position++;
+    } while (x == y && x != EOF);
+
+    fclose(a);
+    fclose(b);
+    *difference = position - 1;
+    return x != y;
+}
+
+long file_size(const char* filename)
+{
+    FILE *file;
+    long size;
+
+    file = fopen(filename, "rb");
+    if (file == NULL)
+    {
+        return 0;
+    }
+    fseek(file, 0L, SEEK_END);
+    size = ftell(file);
+    fclose(file);
+    return size;
+}
+
+void write_program(const char* filename, const char* code, size_t length)
+{
+    FILE *file;
+
+    file = fopen(filename, "wb");
+    if (file == NULL || fwrite(code, 1, length, file) != length || fclose(file) != 0)
+    {
+        perror("Error writing program");
+        exit(EXIT_FAILURE);
+    }
+}
+
+unsigned long next_random()
+{
+    /* 64 bit LCG (Knuth MMIX), deterministic on every host */
+    random_state = random_state * 6364136223846793005UL + 1442695040888963407UL;
+    return random_state >> 33;
+}
+
+char* random_program(size_t* length)
+{
+    /* mostly instructions, some arbitrary bytes, occasionally a huge run */
+    char* code;
+    size_t i, run;
+
+    *length = next_random() % 2000;
+    code = malloc(*length + 1);
+    for (i = 0; i < *length; i++)
+    {
+        if (next_random() % 10 < 7)
+        {
+            code[i] = "HQ9+"[next_random() % 4];
+        }
+        else
+        {
+            code[i] = (char) (next_random() % 256);
+        }
+
+        if (next_random() % 100 == 0)
+        {
+            for (run = next_random() % 500; run > 0 && i + 1 < *length; run--)
+            {
+                code[i + 1] = code[i];
+                i++;
+            }
+        }
+    }
+    return code;
+}
+
+void read_baseline(struct engine* engines, const char* filename)
+{
+    FILE *file;
+    char name[64];
+    double throughput;
+    int i;
+
+    file = fopen(filename, "r");
+    if (file == NULL)
+    {
+        /* record one with -w first */
+        perror("Error reading baseline");
+        exit(EXIT_FAILURE);
+    }
+    while (fscanf(file, "%63s %lf", name, &throughput) == 2)
+    {
+        for (i = 0; i < ENGINE_COUNT; i++)
+        {
+            if (strcmp(name, engines[i].name) == 0)
+            {
+                engines[i].baseline = throughput;
+            }
+        }
+    }
+    fclose(file);
+}
+
+void write_baseline(struct engine* engines, const char* filename)
+{
+    FILE *file;
+    int i;
+
+    file = fopen(filename, "w");
+    if (file == NULL)
+    {
+        perror("Error writing baseline");
+        exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < ENGINE_COUNT; i++)
+    {
+        fprintf(file, "%s %.0f\n", engines[i].name, engines[i].throughput);
+    }
+    fclose(file);
+}
@@ -0,0 +1,494 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "../process/process.h"
+
+/*
+Driver for HQ9+ files (http://esolangs.org/wiki/HQ9)
+Picks the engine with the lowest predicted latency and runs the program with it.
+
+Every engine is predicted by a linear cost model over a quick scan of the program:
+    time = fixed + source_bytes * per_source_byte + plus_count * per_plus
+                 + print_count * per_print + output_bytes * per_output_byte
+
+The interpreter has no compile cost, the jit compiler grows with the program size
+and the compiler pays for gcc, but its output runs fastest. The coefficients are
+calibrated once by timing random probe programs on this host and stored in
+$HQ9_CALIBRATION (default ~/.hq9-calibration), together with the path, modification
+time and size of every engine. A moved or rebuilt engine triggers a recalibration.
+
+Limitation: the compiler and the jit compiler grammar compress the program (see
+../grammar/grammar.c), so their cost grows with the grammar size, not with the raw
+instruction counts the scan reports. Even random probes compress, and by a ratio that
+changes with their length: a 20000 symbol '+H' probe compiles to about 3800 calls,
+one 8 times as long to about 22300. The model is therefore only accurate near the
+probe sizes, and it overestimates both engines on highly repetitive programs.
+
+Compile the engines as described in their sources, then compile the driver:
+    gcc -ansi -pedantic -Wall hq9.c ../process/process.c -o hq9
+
+Run a program:
+    ./hq9 ../main.hq9+
+
+Options:
+    -v  report the scan, the predictions and the decision on stderr
+    -c  recalibrate the cost model
+
+Engines are looked up in $HQ9_INTERPRETER, $HQ9_COMPILER and $HQ9_JIT
+(default ../<engine>/HQ9+).
+*/
+
+#define ENGINE_COUNT 3
+/* probe lengths, multiples of the alphabet lengths in fit */
+#define PROBE_SIZE 20000
+#define PROBE_NINES 200
+#define PROBE_SEED 2718281828UL
+#define MAX_PROBE_SCALE 8
+#define REPETITIONS 3
+
+/* output of the instructions, identical in all engines */
+#define HELLO_LENGTH 13
+#define LYRICS_LENGTH 11786
+
+enum coefficient { FIXED, PER_SOURCE_BYTE, PER_PLUS, PER_PRINT, PER_OUTPUT_BYTE, COEFFICIENT_COUNT };
+
+struct scan {
+  double source_bytes;
+  double plus_count;
+  double print_count;
+  double output_bytes;
+};
+
+struct engine {
+  const char* name;
+  const char* variable;
+  char* path;
+  int (*run) (struct engine* engine, char* program, const char* output);
+  double cost[COEFFICIENT_COUNT];
+};
+
+int run_interpreted(struct engine* engine, char* program, const char* output);
+int run_compiled(struct engine* engine, char* program, const char* output);
+void scan_program(char* filename, struct scan* scan);
+double predict(struct engine* engine, struct scan* scan);
+void calibrate(struct engine* engines, const char* calibration);
+int read_calibration(struct engine* engines, const char* filename);
+void write_calibration(struct engine* engines, const char* filename);
+
+int main(int argc, char **argv)
+{
+    struct engine engines[ENGINE_COUNT] = {
+        { "interpreter", "HQ9_INTERPRETER", "../interpreter/HQ9+", run_interpreted, { 0 } },
+        { "compiler", "HQ9_COMPILER", "../compiler/HQ9+", run_compiled, { 0 } },
+        { "jit", "HQ9_JIT", "../jit/HQ9+", run_interpreted, { 0 } }
+    };
+    char calibration[4096];
+    struct scan scan;
+    int verbose = 0;
+    int recalibrate = 0;
+    int option;
+    int best = 0;
+    double prediction;
+    double best_prediction = 0;
+    int i;
+
+    while ((option = getopt(argc, argv, "vc")) != -1)
+    {
+        switch (option)
+        {
+            case 'v': verbose = 1; break;
+            case 'c': recalibrate = 1; break;
+            default:
+                fprintf(stderr, "Usage: %s [-v] [-c] <HQ9+ source file>\n", argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+    if (optind != argc - 1)
+    {
+        /* wrong number of args */
+        fprintf(stderr, "Error: exactly 1 HQ9+ source file as arg required\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (i = 0; i < ENGINE_COUNT; i++)
+    {
+        if (getenv(engines[i].variable) != NULL)
+        {
+            engines[i].path = getenv(engines[i].variable);
+        }
+    }
+
+    /* cost model */
+    if (getenv("HQ9_CALIBRATION") != NULL)
+    {
+        snprintf(calibration, sizeof(calibration), "%s", getenv("HQ9_CALIBRATION"));
+    }
+    else
+    {
+        snprintf(calibration, sizeof(calibration), "%s/.hq9-calibration", getenv("HOME") != NULL ? getenv("HOME") : ".");
+    }
+    if (recalibrate || !read_calibration(engines, calibration))
+    {
+        if (verbose)
+        {
+            fprintf(stderr, "calibrating cost model on this host\n");
+        }
+        calibrate(engines, calibration);
+        write_calibration(engines, calibration);
+    }
+
+    /* pick the engine with the lowest predicted latency */
+    scan_program(argv[optind], &scan);
+    if (verbose)
+    {
+        fprintf(stderr, "scan: %.0f source bytes, %.0f prints, %.0f increments, %.0f output bytes\n",
+                scan.source_bytes, scan.print_count, scan.plus_count, scan.output_bytes);
+    }
+    for (i = 0; i < ENGINE_COUNT; i++)
+    {
+        prediction = predict(&engines[i], &scan);
+        if (verbose)
+        {
+            fprintf(stderr, "  %-12s %10.3f ms\n", engines[i].name, prediction * 1e3);
+        }
+        if (i == 0 || prediction < best_prediction)
+        {
+            best = i;
+            best_prediction = prediction;
+        }
+    }
+    if (verbose)
+    {
+        fprintf(stderr, "running %s\n", engines[best].name);
+    }
+
+    exit(engines[best].run(&engines[best], argv[optind], NULL) == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+void scan_program(char* filename, struct scan* scan)
+{
+    FILE *file;
+    int instruction;
+    double nines = 0;
+    double sources = 0;
+    double hellos = 0;
+
+    file = fopen(filename, "rb");
+    if (file == NULL)
+    {
+        perror("Error opening file");
+        exit(EXIT_FAILURE);
+    }
+
+    memset(scan, 0, sizeof(struct scan));
+    while ((instruction = getc(file)) != EOF)
+    {
+        scan->source_bytes++;
+        switch (instruction)
+        {
+            case 'H': hellos++; break;
+            case 'Q': sources++; break;
+            case '9': nines++; break;
+            case '+': scan->plus_count++; break;
+        }
+    }
+    fclose(file);
+
+    scan->print_count = hellos + sources + nines;
+    scan->output_bytes = hellos * HELLO_LENGTH + sources * scan->source_bytes + nines * LYRICS_LENGTH;
+}
+
+double predict(struct engine* engine, struct scan* scan)
+{
+    return engine->cost[FIXED]
+        + engine->cost[PER_SOURCE_BYTE] * scan->source_bytes
+        + engine->cost[PER_PLUS] * scan->plus_count
+        + engine->cost[PER_PRINT] * scan->print_count
+        + engine->cost[PER_OUTPUT_BYTE] * scan->output_bytes;
+}
+
+/* best of REPETITIONS wall clock seconds of a probe program */
+double time_probe(struct engine* engine, char* program, char* output, const char* alphabet, size_t length)
+{
+    /*
+        The probe holds every character of alphabet equally often, in seeded random
+        order, so it does not collapse into a single loop rule like a run of one
+        character would. It still compresses, see the limitation at the top.
+    */
+    FILE *file;
+    char* probe;
+    struct timespec start, end;
+    double seconds;
+    double best = -1;
+    unsigned long state = PROBE_SEED;
+    size_t alphabet_length = strlen(alphabet);
+    size_t i, j;
+    char swap;
+    int repetition;
+
+    probe = malloc(length + 1);
+    if (probe == NULL)
+    {
+        perror("Error allocating probe");
+        exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < length; i++)
+    {
+        probe[i] = alphabet[i % alphabet_length];
+    }
+    /* Fisher-Yates shuffle, 32 bit LCG (Numerical Recipes), the low bits are weak */
+    for (i = length; i > 1; i--)
+    {
+        state = (state * 1664525UL + 1013904223UL) & 0xFFFFFFFFUL;
+        j = (size_t) ((state >> 8) % i);
+        swap = probe[i - 1];
+        probe[i - 1] = probe[j];
+        probe[j] = swap;
+    }
+
+    file = fopen(program, "wb");
+    if (file == NULL || fwrite(probe, 1, length, file) != length || fclose(file) != 0)
+    {
+        perror("Error writing probe");
+        exit(EXIT_FAILURE);
+    }
+    free(probe);
+
+    for (repetition = 0; repetition < REPETITIONS; repetition++)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        if (engine->run(engine, program, output) != 0)
+        {
+            fprintf(stderr, "Error: %s (%s) did not run\n", engine->name, engine->path);
+            exit(EXIT_FAILURE);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+        if (best < 0 || seconds < best)
+        {
+            best = seconds;
+        }
+    }
+    return best;
+}
+
+/* fit the coefficients of one engine on probes scaled by scale, returns 0 if none is negative */
+int fit(struct engine* engine, char* program, char* output, int scale)
+{
+    /*
+        Micro-benchmark on random probes (see time_probe), per instruction costs:
+            empty file          fixed
+            spaces              per source byte
+            '+' 'H' 1:1         per increment + per hello
+            '+' 'H' 3:1         3 per increment + per hello
+            'H' '9' 1:1         per print and per output byte, given per hello
+        with per hello = per print + HELLO_LENGTH * per output byte.
+    */
+    double fixed, spaces, even, plus_heavy, prints;
+    double source, plus, hello;
+    size_t n = PROBE_SIZE * scale;
+    size_t k = PROBE_NINES * scale;
+    int c;
+
+    fixed = time_probe(engine, program, output, "", 0);
+    spaces = time_probe(engine, program, output, " ", n);
+    even = time_probe(engine, program, output, "+H", n);
+    plus_heavy = time_probe(engine, program, output, "+++H", n);
+    prints = time_probe(engine, program, output, "H9", k);
+
+    source = (spaces - fixed) / n;
+    engine->cost[FIXED] = fixed;
+    engine->cost[PER_SOURCE_BYTE] = source;
+
+    /* per group of the alphabet: even = plus + hello, plus_heavy = 3 plus + hello */
+    even = (even - fixed - source * n) / (n / 2);
+    plus_heavy = (plus_heavy - fixed - source * n) / (n / 4);
+    plus = (plus_heavy - even) / 2;
+    hello = even - plus;
+    engine->cost[PER_PLUS] = plus;
+
+    /* per group of the alphabet: prints = 2 per print + (HELLO_LENGTH + LYRICS_LENGTH) per output byte */
+    prints = (prints - fixed - source * k) / (k / 2);
+    engine->cost[PER_OUTPUT_BYTE] = (prints - 2 * hello) / (LYRICS_LENGTH - HELLO_LENGTH);
+    engine->cost[PER_PRINT] = hello - HELLO_LENGTH * engine->cost[PER_OUTPUT_BYTE];
+
+    for (c = 0; c < COEFFICIENT_COUNT; c++)
+    {
+        if (engine->cost[c] < 0)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void calibrate(struct engine* engines, const char* calibration)
+{
+    /*
+        Probes run in a scratch directory next to the calibration file and write
+        their output into a regular file there, like real runs do; /dev/null would
+        make output free. A negative coefficient is noise drowning the signal, so the
+        engine is refitted on larger probes before anything is given up; larger probes
+        compress better, so the refit describes a different compression ratio.
+    */
+    const char* names[COEFFICIENT_COUNT] = { "fixed", "per_source_byte", "per_plus", "per_print", "per_output_byte" };
+    char directory[4096];
+    char program[4096 + 16];
+    char output[4096 + 16];
+    char* cache = getenv("HQ9_CACHE_DIR");
+    int scale;
+    int i, c;
+
+    snprintf(directory, sizeof(directory), "%s.XXXXXX", calibration);
+    if (mkdtemp(directory) == NULL)
+    {
+        perror("Error creating calibration directory");
+        exit(EXIT_FAILURE);
+    }
+    sprintf(program, "%s/probe.hq9", directory);
+    sprintf(output, "%s/probe.out", directory);
+
+    /* probes are repeated, the output cache would time itself instead of the engines */
+    if (cache != NULL)
+    {
+        cache = strdup(cache);
+        unsetenv("HQ9_CACHE_DIR");
+    }
+
+    for (i = 0; i < ENGINE_COUNT; i++)
+    {
+        for (scale = 1; fit(&engines[i], program, output, scale) != 0 && scale < MAX_PROBE_SCALE; scale *= 2)
+        {
+        }
+
+        /* still negative on the largest probes: the cost is below the noise, say so */
+        for (c = 0; c < COEFFICIENT_COUNT; c++)
+        {
+            if (engines[i].cost[c] < 0)
+            {
+                fprintf(stderr, "Warning: %s %s fitted to %g s, below measurement noise, using 0\n",
+                        engines[i].name, names[c], engines[i].cost[c]);
+                engines[i].cost[c] = 0;
+            }
+        }
+    }
+
+    unlink(program);
+    unlink(output);
+    rmdir(directory);
+    if (cache != NULL)
+    {
+        setenv("HQ9_CACHE_DIR", cache, 1);
+        free(cache);
+    }
+}
+
+/* identifies an engine build, a rebuilt engine invalidates its calibration */
+void stamp_engine(struct engine* engine, long* modified, long* size)
+{
+    struct stat status;
+
+    *modified = -1;
+    *size = -1;
+    if (stat(engine->path, &status) == 0)
+    {
+        *modified = (long) status.st_mtime;
+        *size = (long) status.st_size;
+    }
+}
+
+int read_calibration(struct engine* engines, const char* filename)
+{
+    /* per line: name modified size coefficients... path */
+    FILE *file;
+    char name[64];
+    char path[4096];
+    double cost[COEFFICIENT_COUNT];
+    long modified, size;
+    long current_modified, current_size;
+    int found = 0;
+    int i;
+
+    file = fopen(filename, "r");
+    if (file == NULL)
+    {
+        return 0;
+    }
+    while (fscanf(file, "%63s %ld %ld %lf %lf %lf %lf %lf ", name, &modified, &size,
+                  &cost[0], &cost[1], &cost[2], &cost[3], &cost[4]) == 8
+           && fgets(path, sizeof(path), file) != NULL)
+    {
+        path[strcspn(path, "\n")] = '\0';
+        for (i = 0; i < ENGINE_COUNT; i++)
+        {
+            stamp_engine(&engines[i], &current_modified, &current_size);
+            if (strcmp(name, engines[i].name) == 0 && strcmp(path, engines[i].path) == 0
+                && modified == current_modified && size == current_size && modified != -1)
+            {
+                memcpy(engines[i].cost, cost, sizeof(cost));
+                found++;
+            }
+        }
+    }
+    fclose(file);
+    return found == ENGINE_COUNT;
+}
+
+void write_calibration(struct engine* engines, const char* filename)
+{
+    FILE *file;
+    long modified, size;
+    int i, c;
+
+    file = fopen(filename, "w");
+    if (file == NULL)
+    {
+        /* not fatal, calibrate again next time */
+        perror("Error writing calibration");
+        return;
+    }
+    for (i = 0; i < ENGINE_COUNT; i++)
+    {
+        stamp_engine(&engines[i], &modified, &size);
+        fprintf(file, "%s %ld %ld", engines[i].name, modified, size);
+        for (c = 0; c < COEFFICIENT_COUNT; c++)
+        {
+            fprintf(file, " %.6g", engines[i].cost[c]);
+        }
+        fprintf(file, " %s\n", engines[i].path);
+    }
+    fclose(file);
+}
+
+int run_interpreted(struct engine* engine, char* program, const char* output)
+{
+    return process_run(engine->path, program, output);
+}
+
+int run_compiled(struct engine* engine, char* program, const char* output)
+{
+    char directory[] = "/tmp/hq9-XXXXXX";
+    char build[32];
+    char path[64];
+    int status;
+
+    if (mkdtemp(directory) == NULL)
+    {
+        perror("Error creating build directory");
+        return -1;
+    }
+    sprintf(build, "%s/program", directory);
+
+    status = process_run_compiled(engine->path, program, build, output);
+
+    sprintf(path, "%s.s", build);
+    unlink(path);
+    sprintf(path, "%s.bin", build);
+    unlink(path);
+    rmdir(directory);
+    return status;
+}
@@ -0,0 +1,340 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "grammar.h"
+
+/*
+Grammar compression of HQ9+ instruction streams for the code generators.
+
+A variant of Re-Pair: every pass first collapses runs of the same symbol into
+a loop rule ("HHHH" -> 4 x H), then replaces every pair of adjacent symbols
+that occurs at least twice by a pair rule ("HQ9HQ9" -> AA with A = HQ9).
+Passes repeat until no pair repeats, so "HQ9" * 1000000 becomes three rules
+and a single loop, and the generated code grows with the information content
+of the program instead of its length.
+
+Each pass is linear in the current sequence and shrinks it, usually by half.
+All passes share one hash table, sized by the number of distinct keys.
+
+Afterwards uses counts the references to every rule: the code generators emit
+rules used more than once as subroutines and inline the others. Loop rules whose
+unrolled body is no bigger than the loop overhead are unrolled; both code
+generators decide this here, with their own code sizes.
+*/
+
+/* bound the number of passes for sequences that shrink only slowly */
+#define GRAMMAR_MAX_PASSES 64
+
+/* open addressing hash table from (symbol, value) to occurrences and rule */
+struct grammar_entry {
+  int symbol;
+  unsigned long value;
+  unsigned long count;
+  int rule;
+};
+
+struct grammar_table {
+  struct grammar_entry* entries;
+  size_t mask;
+  size_t keys;
+};
+
+static void* grammar_alloc(struct grammar* const grammar, void* data, size_t size, size_t new_size)
+{
+    void* grown;
+
+    if (grammar->grow == NULL)
+    {
+        grown = realloc(data, new_size);
+    }
+    else
+    {
+        grown = grammar->grow(grammar->context, data, size, new_size);
+    }
+    if (grown == NULL)
+    {
+        perror("Error allocating grammar");
+        exit(EXIT_FAILURE);
+    }
+    return grown;
+}
+
+static void grammar_free(struct grammar* const grammar, void* data)
+{
+    /* memory from grow is released by its owner */
+    if (grammar->grow == NULL)
+    {
+        free(data);
+    }
+}
+
+static void table_clear(struct grammar_table* const table)
+{
+    size_t i;
+
+    for (i = 0; i <= table->mask; i++)
+    {
+        table->entries[i].symbol = -1;
+    }
+    table->keys = 0;
+}
+
+static struct grammar_entry* table_slot(struct grammar_table* const table, int symbol, unsigned long value)
+{
+    size_t i = ((unsigned long) symbol * 2654435761UL ^ value * 40503UL) & table->mask;
+
+    /* the table has at least twice as many slots as keys, there is always a free one */
+    while (table->entries[i].symbol != -1
+           && (table->entries[i].symbol != symbol || table->entries[i].value != value))
+    {
+        i = (i + 1) & table->mask;
+    }
+    return &table->entries[i];
+}
+
+static void table_resize(struct grammar* const grammar, struct grammar_table* const table, size_t size)
+{
+    struct grammar_entry* entries = table->entries;
+    size_t old_size = entries == NULL ? 0 : table->mask + 1;
+    size_t i;
+
+    table->entries = grammar_alloc(grammar, NULL, 0, size * sizeof(struct grammar_entry));
+    table->mask = size - 1;
+    table_clear(table);
+    for (i = 0; i < old_size; i++)
+    {
+        if (entries[i].symbol != -1)
+        {
+            *table_slot(table, entries[i].symbol, entries[i].value) = entries[i];
+            table->keys++;
+        }
+    }
+    grammar_free(grammar, entries);
+}
+
+static struct grammar_entry* table_find(struct grammar* const grammar, struct grammar_table* const table,
+                                        int symbol, unsigned long value)
+{
+    struct grammar_entry* entry = table_slot(table, symbol, value);
+
+    if (entry->symbol == -1)
+    {
+        if (2 * (table->keys + 1) > table->mask + 1)
+        {
+            table_resize(grammar, table, 2 * (table->mask + 1));
+            entry = table_slot(table, symbol, value);
+        }
+        table->keys++;
+        entry->symbol = symbol;
+        entry->value = value;
+        entry->count = 0;
+        entry->rule = -1;
+    }
+    return entry;
+}
+
+static int add_rule(struct grammar* const grammar, size_t* capacity, enum grammar_rule_kind kind,
+                    int left, int right, unsigned long count)
+{
+    struct grammar_rule* rule;
+
+    if (grammar->rule_count == *capacity)
+    {
+        *capacity = *capacity == 0 ? 64 : *capacity * 2;
+        grammar->rules = grammar_alloc(grammar, grammar->rules, grammar->rule_count * sizeof(struct grammar_rule),
+                                       *capacity * sizeof(struct grammar_rule));
+    }
+    rule = &grammar->rules[grammar->rule_count];
+    rule->kind = kind;
+    rule->left = left;
+    rule->right = right;
+    rule->count = count;
+    rule->uses = 0;
+    return GRAMMAR_RULES + (int) grammar->rule_count++;
+}
+
+/* runs of the same symbol -> loop rules, returns the new length */
+static size_t collapse_runs(struct grammar* const grammar, struct grammar_table* const table, size_t* capacity)
+{
+    struct grammar_entry* entry;
+    int* sequence = grammar->start;
+    size_t length = grammar->length;
+    size_t read = 0;
+    size_t written = 0;
+    size_t run;
+
+    table_clear(table);
+    while (read < length)
+    {
+        for (run = 1; read + run < length && sequence[read + run] == sequence[read]; run++)
+        {
+        }
+        if (run == 1)
+        {
+            sequence[written++] = sequence[read];
+        }
+        else
+        {
+            entry = table_find(grammar, table, sequence[read], run);
+            if (entry->rule == -1)
+            {
+                entry->rule = add_rule(grammar, capacity, GRAMMAR_LOOP, sequence[read], 0, run);
+            }
+            sequence[written++] = entry->rule;
+        }
+        read += run;
+    }
+    return written;
+}
+
+/* repeated pairs -> pair rules, returns the new length */
+static size_t replace_pairs(struct grammar* const grammar, struct grammar_table* const table, size_t* capacity)
+{
+    struct grammar_entry* entry;
+    int* sequence = grammar->start;
+    size_t length = grammar->length;
+    size_t read = 0;
+    size_t written = 0;
+    size_t i;
+
+    /* no runs left, so occurrences of a pair never overlap */
+    table_clear(table);
+    for (i = 0; i + 1 < length; i++)
+    {
+        table_find(grammar, table, sequence[i], (unsigned long) sequence[i + 1])->count++;
+    }
+
+    while (read < length)
+    {
+        if (read + 1 < length)
+        {
+            entry = table_find(grammar, table, sequence[read], (unsigned long) sequence[read + 1]);
+            if (entry->count >= 2)
+            {
+                if (entry->rule == -1)
+                {
+                    entry->rule = add_rule(grammar, capacity, GRAMMAR_PAIR, sequence[read], sequence[read + 1], 0);
+                }
+                sequence[written++] = entry->rule;
+                read += 2;
+                continue;
+            }
+        }
+        sequence[written++] = sequence[read++];
+    }
+    return written;
+}
+
+void grammar_create(struct grammar* const grammar, const char* program, size_t length,
+                    grammar_grow_fn* grow, void* context)
+{
+    struct grammar_table table;
+    size_t capacity = 0;
+    size_t previous_length;
+    size_t i;
+    int pass;
+
+    grammar->rules = NULL;
+    grammar->rule_count = 0;
+    grammar->length = 0;
+    grammar->grow = grow;
+    grammar->context = context;
+    grammar->start = grammar_alloc(grammar, NULL, 0, (length + 1) * sizeof(int));
+
+    /* only instructions are part of the grammar */
+    for (i = 0; i < length; i++)
+    {
+        switch (program[i])
+        {
+            case 'H': case 'Q': case '9': case '+':
+                grammar->start[grammar->length++] = program[i];
+                break;
+        }
+    }
+
+    table.entries = NULL;
+    table_resize(grammar, &table, 16);
+    for (pass = 0; pass < GRAMMAR_MAX_PASSES; pass++)
+    {
+        previous_length = grammar->length;
+        grammar->length = collapse_runs(grammar, &table, &capacity);
+        grammar->length = replace_pairs(grammar, &table, &capacity);
+        if (grammar->length == previous_length)
+        {
+            break;
+        }
+    }
+    grammar_free(grammar, table.entries);
+
+    /* references to every rule, from the start sequence and from other rules */
+    for (i = 0; i < grammar->length; i++)
+    {
+        if (GRAMMAR_IS_RULE(grammar->start[i]))
+        {
+            GRAMMAR_RULE(grammar, grammar->start[i])->uses++;
+        }
+    }
+    for (i = 0; i < grammar->rule_count; i++)
+    {
+        struct grammar_rule* rule = &grammar->rules[i];
+        if (GRAMMAR_IS_RULE(rule->left))
+        {
+            GRAMMAR_RULE(grammar, rule->left)->uses++;
+        }
+        if (rule->kind == GRAMMAR_PAIR && GRAMMAR_IS_RULE(rule->right))
+        {
+            GRAMMAR_RULE(grammar, rule->right)->uses++;
+        }
+    }
+}
+
+static int loop_pays_off(const struct grammar_sizes* sizes, const struct grammar_rule* rule, size_t body_size)
+{
+    /* count * body_size > loop overhead, without overflowing */
+    return rule->count > sizes->loop / body_size;
+}
+
+size_t grammar_symbol_size(const struct grammar* grammar, const struct grammar_sizes* sizes, int symbol)
+{
+    switch (symbol)
+    {
+        case 'H': case 'Q': case '9': return sizes->print;
+        case '+': return sizes->plus;
+    }
+    if (GRAMMAR_RULE(grammar, symbol)->uses >= 2)
+    {
+        return sizes->call;
+    }
+    return grammar_rule_size(grammar, sizes, symbol);
+}
+
+size_t grammar_rule_size(const struct grammar* grammar, const struct grammar_sizes* sizes, int symbol)
+{
+    const struct grammar_rule* rule = GRAMMAR_RULE(grammar, symbol);
+    size_t body_size;
+
+    if (rule->kind == GRAMMAR_PAIR)
+    {
+        return grammar_symbol_size(grammar, sizes, rule->left) + grammar_symbol_size(grammar, sizes, rule->right);
+    }
+    /* the body is measured once, measuring it again per level would be exponential in nested loops */
+    body_size = grammar_symbol_size(grammar, sizes, rule->left);
+    if (loop_pays_off(sizes, rule, body_size))
+    {
+        return sizes->loop + body_size;
+    }
+    return rule->count * body_size;
+}
+
+int grammar_is_loop(const struct grammar* grammar, const struct grammar_sizes* sizes, const struct grammar_rule* rule)
+{
+    return loop_pays_off(sizes, rule, grammar_symbol_size(grammar, sizes, rule->left));
+}
+
+void grammar_destroy(struct grammar* grammar)
+{
+    grammar_free(grammar, grammar->start);
+    grammar_free(grammar, grammar->rules);
+    grammar->start = NULL;
+    grammar->rules = NULL;
+}
@@ -0,0 +1,58 @@
+/* symbols below GRAMMAR_RULES are instructions ('H', 'Q', '9', '+'), all others rules */
+#define GRAMMAR_RULES 256
+#define GRAMMAR_IS_RULE(symbol) ((symbol) >= GRAMMAR_RULES)
+#define GRAMMAR_RULE(grammar, symbol) (&(grammar)->rules[(symbol) - GRAMMAR_RULES])
+
+enum grammar_rule_kind {
+  GRAMMAR_PAIR,
+  GRAMMAR_LOOP
+};
+
+/*
+    GRAMMAR_PAIR: left right
+    GRAMMAR_LOOP: left repeated count times
+    Rules only refer to instructions and rules with lower index.
+*/
+struct grammar_rule {
+  enum grammar_rule_kind kind;
+  int left;
+  int right;
+  unsigned long count;
+  unsigned long uses;
+};
+
+/* grows a buffer of size bytes to new_size bytes, like realloc */
+typedef void* grammar_grow_fn (void* context, void* buffer, size_t size, size_t new_size);
+
+struct grammar {
+  int* start;
+  size_t length;
+  struct grammar_rule* rules;
+  size_t rule_count;
+  grammar_grow_fn* grow;
+  void* context;
+};
+
+/*
+    Code sizes in bytes of a backend: instructions, calls of rules used more than once,
+    and the overhead of a counted loop around its body. Rules used once are inline.
+*/
+struct grammar_sizes {
+  size_t print;
+  size_t plus;
+  size_t call;
+  size_t loop;
+};
+
+/*
+    Memory comes from grow(context, ...), e.g. an arena that releases it in one go,
+    or from realloc and free if grow is NULL.
+*/
+void grammar_create (struct grammar* const grammar, const char* program, size_t length,
+                     grammar_grow_fn* grow, void* context);
+void grammar_destroy (struct grammar* grammar);
+
+/* code size of a symbol where it is used, of the body of a rule, and whether a loop rule is emitted as loop */
+size_t grammar_symbol_size (const struct grammar* grammar, const struct grammar_sizes* sizes, int symbol);
+size_t grammar_rule_size (const struct grammar* grammar, const struct grammar_sizes* sizes, int symbol);
+int grammar_is_loop (const struct grammar* grammar, const struct grammar_sizes* sizes, const struct grammar_rule* rule);
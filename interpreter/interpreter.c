@@ -1,21 +1,36 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include "../cache/cache.h"
+#include "../compress/lz.h"
+#include "../source/source.h"
 
 /*
 Interpreter for HQ9+ files (http://esolangs.org/wiki/HQ9)
 
 Compiling the interpreter:
-    gcc -ansi -pedantic -Wall interpreter.c -o HQ9+
+    gcc -ansi -pedantic -Wall interpreter.c ../cache/cache.c ../compress/lz.c ../source/source.c -o HQ9+
 
 Using the interpreter:
     ./HQ9+ ../main.hq9+
 
+Writing compressed output (decompress with compress/hq9z -d):
+    ./HQ9+ -z ../main.hq9+ > output.hq9z
+
+Serving repeated programs from the output cache (see cache/cache.c):
+    HQ9_CACHE_DIR=/tmp/hq9-cache ./HQ9+ ../main.hq9+
+
 H: Print "hello, world"
 Q: Print the program's source code
 9: Print the lyrics to "99 Bottles of Beer"
 +: Increment the accumulator
 */
 
+/* part of the cache key, bump whenever the output changes */
+#define ENGINE_VERSION "interpreter-2"
+
+void emit_instruction(char instruction, char* filename);
+void compress_program(FILE* file, char* filename);
 void print_hello_world();
 void print_source_code(char* filename);
 void print_bottles_of_beer(int initial_bottle_count);
@@ -24,11 +39,13 @@ void increment_the_accumulator(int* accumulator);
 int main(int argc, char **argv)
 {
     FILE *file;
-    char instruction;
+    int instruction;
     char* filename;
     int the_accumulator = 0;
+    struct cache cache;
+    int compressed = argc == 3 && strcmp(argv[1], "-z") == 0;
     
-    if (argc != 2)
+    if (argc != 2 && !compressed)
     {
         /* Wrong number of args */
         fprintf(stderr, "Error: exactly 1 HQ9+ source file as arg required\n");
@@ -36,7 +53,7 @@ int main(int argc, char **argv)
     }
     
     /* Open file */
-    filename = argv[1];
+    filename = argv[argc - 1];
     file = fopen(filename, "r");
     if (file == NULL)
     {
@@ -44,6 +61,22 @@ int main(int argc, char **argv)
         exit(EXIT_FAILURE); 
     }
     
+    /* Compressed output is a few bytes per instruction, no need to cache it */
+    if (compressed)
+    {
+        compress_program(file, filename);
+        fclose(file);
+        exit(EXIT_SUCCESS);
+    }
+    
+    /* Serve repeated programs from the output cache */
+    if (cache_open(&cache, ENGINE_VERSION, filename, emit_instruction) && cache_serve(&cache))
+    {
+        fclose(file);
+        exit(EXIT_SUCCESS);
+    }
+    cache_begin(&cache);
+    
     /* Parse file */
     while ((instruction = fgetc(file)) != EOF)
     {
@@ -71,11 +104,76 @@ int main(int argc, char **argv)
     /* Close file */
     fclose(file);
     
+    /* Store the output in the cache */
+    cache_end(&cache);
+    
     exit(EXIT_SUCCESS);
 }
 
 
 
+void compress_program(FILE* file, char* filename)
+{
+    struct lz_writer writer;
+    char* source;
+    size_t length;
+    int instruction;
+    
+    /* Every instruction becomes a reference into the preloaded dictionary */
+    source = source_read(filename, &length, NULL, NULL);
+    if (source == NULL)
+    {
+        perror("Could not read file into buffer");
+        exit(EXIT_FAILURE);
+    }
+    lz_writer_create(&writer, stdout, source, length);
+    free(source);
+    
+    while ((instruction = fgetc(file)) != EOF)
+    {
+        switch (instruction)
+        {
+            case 'H':
+                lz_reference(&writer, LZ_HELLO);
+                break;
+            case 'Q':
+                lz_reference(&writer, LZ_SOURCE);
+                break;
+            case '9':
+                lz_reference(&writer, LZ_LYRICS);
+                break;
+        }
+    }
+    if (!feof(file))
+    {
+        perror("Error reading file");
+    }
+    
+    if (lz_writer_destroy(&writer) != 0)
+    {
+        perror("Error writing output");
+        exit(EXIT_FAILURE);
+    }
+}
+
+
+void emit_instruction(char instruction, char* filename)
+{
+    switch (instruction)
+    {
+        case 'H':
+            print_hello_world();
+            break;
+        case 'Q':
+            print_source_code(filename);
+            break;
+        case '9':
+            print_bottles_of_beer(99);
+            break;
+    }
+}
+
+
 void print_hello_world()
 {
     printf("hello, world\n");
@@ -89,7 +187,7 @@ void print_source_code(char* filename)
     
     /* Open file again for second independent seek point indicator.
        Read only -> No problem to have same file open multiple times. */
-    file = fopen(filename, "r");
+    file = fopen(filename, "rb");
     if (file == NULL)
     {
         perror("Error opening file");
@@ -109,31 +207,31 @@ void print_source_code(char* filename)
 void print_bottles_of_beer(int initial_bottle_count)
 {
     int bottle_count;
-    char plural_s;
+    char* pluralized_bottle;
 
     for (bottle_count = initial_bottle_count; bottle_count >= 0; bottle_count--)
     {
         if (bottle_count > 0)
         {
-            plural_s = bottle_count == 1 ? '\0' : 's';
-            printf("%d bottle%c of beer on the wall, %d bottle%c of beer.\n" \
-                     "Take one down and pass it around, ", bottle_count, plural_s, bottle_count, plural_s);
+            pluralized_bottle = bottle_count == 1 ? "bottle" : "bottles";
+            printf("%d %s of beer on the wall, %d %s of beer.\n" \
+                     "Take one down and pass it around, ", bottle_count, pluralized_bottle, bottle_count, pluralized_bottle);
             if (bottle_count == 1)
             {
                 printf("no more bottles of beer on the wall.\n");
             }
             else
             {
-                plural_s = bottle_count-1 == 1 ? '\0' : 's';
-                printf("%d bottle%c of beer on the wall.\n", bottle_count-1, plural_s);
+                pluralized_bottle = bottle_count-1 == 1 ? "bottle" : "bottles";
+                printf("%d %s of beer on the wall.\n", bottle_count-1, pluralized_bottle);
             }
         }
         else
         {
-            plural_s = initial_bottle_count == 1 ? '\0' : 's';
+            pluralized_bottle = initial_bottle_count == 1 ? "bottle" : "bottles";
             printf("No more bottles of beer on the wall, no more bottles of beer.\n" \
             "Go to the store and buy some more, " \
-            "%d bottle%c of beer on the wall.\n", initial_bottle_count, plural_s);
+            "%d %s of beer on the wall.\n", initial_bottle_count, pluralized_bottle);
         }
     }
 }
@@ -0,0 +1,68 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "arena.h"
+
+/* every allocation is 16 byte aligned, so is the block header */
+#define ARENA_ALIGN(size) (((size) + 15) & ~(size_t) 15)
+#define ARENA_HEADER ARENA_ALIGN(sizeof(struct arena_block))
+
+void arena_create (struct arena* const arena, size_t block_size) {
+    arena->head = NULL;
+    arena->block_size = block_size;
+    arena->last = NULL;
+}
+
+void arena_destroy (struct arena* arena) {
+    // everything allocated from the arena is released in one go
+    struct arena_block* block = arena->head;
+    while (block != NULL) {
+        struct arena_block* next = block->next;
+        free(block);
+        block = next;
+    }
+    arena->head = NULL;
+    arena->last = NULL;
+}
+
+void* arena_alloc (struct arena* const arena, size_t size) {
+    struct arena_block* block = arena->head;
+    size = ARENA_ALIGN(size);
+
+    if (block == NULL || block->used + size > block->size) {
+        size_t block_size = arena->block_size;
+        while (block_size < size) {
+            block_size *= 2;
+        }
+        block = malloc(ARENA_HEADER + block_size);
+        if (block == NULL) {
+            perror("Error allocating arena block");
+            exit(EXIT_FAILURE);
+        }
+        block->size = block_size;
+        block->used = 0;
+        block->next = arena->head;
+        arena->head = block;
+    }
+
+    arena->last = (char*) block + ARENA_HEADER + block->used;
+    block->used += size;
+    return arena->last;
+}
+
+void* arena_grow (struct arena* const arena, void* data, size_t size, size_t new_size) {
+    struct arena_block* block = arena->head;
+
+    // the latest allocation can grow in place, if its block has room left
+    if (data != NULL && data == arena->last
+        && (char*) data + ARENA_ALIGN(new_size) <= (char*) block + ARENA_HEADER + block->size) {
+        block->used = (char*) data - ((char*) block + ARENA_HEADER) + ARENA_ALIGN(new_size);
+        return data;
+    }
+
+    void* grown = arena_alloc(arena, new_size);
+    if (data != NULL) {
+        memcpy(grown, data, size);
+    }
+    return grown;
+}
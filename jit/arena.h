@@ -0,0 +1,16 @@
+struct arena_block {
+  struct arena_block* next;
+  size_t size;
+  size_t used;
+};
+
+struct arena {
+  struct arena_block* head;
+  size_t block_size;
+  void* last;
+};
+
+void arena_create (struct arena* const arena, size_t block_size);
+void arena_destroy (struct arena* arena);
+void* arena_alloc (struct arena* const arena, size_t size);
+void* arena_grow (struct arena* const arena, void* data, size_t size, size_t new_size);
@@ -2,10 +2,15 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
+#include "arena.h"
 #include "vector.h"
+#include "../grammar/grammar.h"
+#include "../cache/cache.h"
+#include "../compress/lz.h"
+#include "../source/source.h"
 
 /*
-TODO: no errors/warnings on 'gcc -ansi -pedantic -Wall jit.c vector.c -o jit'
+TODO: no errors/warnings on 'gcc -ansi -pedantic -Wall jit.c vector.c arena.c ../grammar/grammar.c -o jit'
 
 JIT-Compiler for HQ9+ files (http://esolangs.org/wiki/HQ9)
 
@@ -15,59 +20,172 @@ Q: Print the program's source code
 +: Increment the accumulator
 
 Compile the jit compiler:
-    gcc jit.c vector.c -o jit
+    gcc jit.c vector.c arena.c ../grammar/grammar.c ../cache/cache.c ../compress/lz.c ../source/source.c -o jit
 
 Jit a program:
     ./jit ../main.hq9+
 
+Write compressed output (decompress with compress/hq9z -d):
+    ./jit -z ../main.hq9+ > output.hq9z
+
+Serve repeated programs from the output cache (see cache/cache.c):
+    HQ9_CACHE_DIR=/tmp/hq9-cache ./jit ../main.hq9+
+
 Debug output:
-    gcc jit.c vector.c -o jit && ./jit ../main.hq9+ | hexdump -C
+    gcc jit.c vector.c arena.c ../grammar/grammar.c ../cache/cache.c ../compress/lz.c ../source/source.c -o jit && ./jit ../main.hq9+ | hexdump -C
+
+Repeated instruction sequences are grammar compressed (see grammar/grammar.c):
+rules used more than once become subroutines, runs become counted loops
+unless the unrolled run is no bigger than the loop overhead.
 
 Test assembly:
     gcc -nostartfiles -o assembly_test assembly_code.s && objdump -s assembly_test
 */
 
-void write_to_stack(struct vector* const vec, char* text, int* stack_offset);
-char* get_source_code(char* filename);
-char* get_lyrics(int initial_bottle_count);
-
-/* libc function as assembly argument, for easy access */
-typedef int fn_printf (const char *, ...);
+/* part of the cache key, bump whenever the output changes */
+#define ENGINE_VERSION "jit-2"
+
+/* sizes of the generated code, see main */
+#define PROLOGUE_SIZE 11
+#define PRINT_SIZE 15
+#define REFERENCE_SIZE 8
+#define PLUS_SIZE 4
+#define EPILOGUE_SIZE 8
+#define JUMP_SIZE 5
+#define CALL_SIZE 5
+#define ROUTINE_SIZE 9
+#define LOOP_SIZE 32
+
+/* programs with more generated code and texts are backed by transparent huge pages */
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+/* state to generate the code of instructions and grammar rules */
+struct code_generator {
+    struct vector* stream;
+    struct grammar* grammar;
+    struct grammar_sizes sizes; // code sizes for the unroll decision in the grammar
+    int compressed; // print segment references instead of texts
+    size_t* routines; // code offset per rule, of those emitted as subroutine
+    size_t offset_hello_world, offset_source, offset_bottles; // texts after the code
+    int length_hello_world, length_source, length_bottles;
+};
+
+void emit_instruction(char instruction, char* filename);
+void emit_symbol(struct code_generator* const generator, int symbol);
+void emit_rule(struct code_generator* const generator, int symbol);
+void emit_print(struct vector* const stream, size_t offset, int length);
+void emit_reference(struct vector* const stream, int segment);
+void print(const char* text, size_t length);
+void print_compressed(int segment);
+void* map_code(size_t size, size_t* mapping_size);
+void* grow_in_arena(void* arena, void* data, size_t size, size_t new_size);
+char* get_source_code(struct arena* const arena, char* filename, size_t* length);
+char* get_lyrics(struct arena* const arena, int initial_bottle_count, int* length);
+
+/* output function as assembly argument, for easy access */
+typedef void fn_print (const char *, size_t);
+typedef void fn_print_compressed (int);
+
+/* destination of print_compressed */
+struct lz_writer compressed_output;
 
 int main(int argc, char **argv)
 {
-    FILE *file;
-    char instruction;
     char* filename;
+    struct arena arena;
     struct vector instruction_stream;
+    struct cache cache;
+    struct grammar grammar;
+    struct code_generator generator;
+    size_t i;
+    int compressed = argc == 3 && strcmp(argv[1], "-z") == 0;
 
-    if(argc != 2)
+    if(argc != 2 && !compressed)
     {
         /* wrong number of args */
         fprintf(stderr, "Error: exactly 1 HQ9+ source file as arg required\n");
         exit(EXIT_FAILURE);
     }
 
-    /* open file */
-    filename = argv[1];
-    file = fopen(filename, "r");
-    if (file == NULL)
+    /* read file, all compile-time buffers come from one arena */
+    filename = argv[argc - 1];
+    arena_create(&arena, 64 * 1024);
+    size_t source_length;
+    char* source_code = get_source_code(&arena, filename, &source_length);
+
+    /* serve repeated programs from the output cache, compressed output is not worth caching */
+    if (compressed)
     {
-        /* could not open file */
-        perror("Error opening file");
-        exit(EXIT_FAILURE);
+        lz_writer_create(&compressed_output, stdout, source_code, source_length);
+    }
+    else if (cache_open(&cache, ENGINE_VERSION, filename, emit_instruction) && cache_serve(&cache))
+    {
+        arena_destroy(&arena);
+        exit(EXIT_SUCCESS);
+    }
+
+    char hello_world [] = "hello, world\n";
+    int length_hello_world = strlen(hello_world);
+    int length_source = memchr(source_code, 'Q', source_length) != NULL ? source_length : 0; // only printed by Q
+    int length_bottles = 0;
+    char* lyrics = NULL;
+    if (!compressed)
+    {
+        // compressed output only refers to the texts, they are not needed at run time
+        lyrics = get_lyrics(&arena, 99, &length_bottles);
+    }
+
+
+    /*** compress repeated instruction sequences ***/
+    grammar_create(&grammar, source_code, source_length, grow_in_arena, &arena);
+    generator.grammar = &grammar;
+    generator.compressed = compressed;
+    generator.sizes.print = compressed ? REFERENCE_SIZE : PRINT_SIZE;
+    generator.sizes.plus = PLUS_SIZE;
+    generator.sizes.call = CALL_SIZE;
+    generator.sizes.loop = LOOP_SIZE;
+
+
+    /*** measure generated code, so it can be emitted straight into its final mapping ***/
+    size_t code_size = PROLOGUE_SIZE + JUMP_SIZE + EPILOGUE_SIZE;
+    size_t routines_size = 0;
+    for (i = 0; i < grammar.rule_count; i++)
+    {
+        if (grammar.rules[i].uses >= 2)
+        {
+            routines_size += ROUTINE_SIZE + grammar_rule_size(&grammar, &generator.sizes, GRAMMAR_RULES + (int) i);
+        }
+    }
+    code_size += routines_size;
+    for (i = 0; i < grammar.length; i++)
+    {
+        code_size += grammar_symbol_size(&grammar, &generator.sizes, grammar.start[i]);
+    }
+
+    /*** texts follow the code in the same mapping, prints address them relative to %rip ***/
+    size_t text_size = compressed ? 0 : length_hello_world + length_source + length_bottles;
+    size_t mapping_size;
+    void* mem = map_code(code_size + text_size, &mapping_size);
+    vector_wrap(&instruction_stream, mem, code_size);
+    generator.offset_hello_world = code_size;
+    generator.offset_source = generator.offset_hello_world + length_hello_world;
+    generator.offset_bottles = generator.offset_source + length_source;
+    if (!compressed)
+    {
+        memcpy((char*) mem + generator.offset_hello_world, hello_world, length_hello_world);
+        memcpy((char*) mem + generator.offset_source, source_code, length_source);
+        memcpy((char*) mem + generator.offset_bottles, lyrics, length_bottles);
     }
 
 
     /*** prologue ***/
-    vector_create(&instruction_stream, 100);
     char prologue [] = {
         0x55, // push %rbp
         0x48, 0x89, 0xE5, // mov %rsp, %rbp
 
         // backup %r12 (callee saved register)
         0x41, 0x54, // pushq %r12
-        // store %rdi content (putchar) in %r12 as callee saved
+        // store %rdi content (print) in %r12 as callee saved
         0x49, 0x89, 0xFC, // movq %rdi, %r12
 
         // push accumulator on stack
@@ -75,100 +193,54 @@ int main(int argc, char **argv)
     };
     vector_push(&instruction_stream, prologue, sizeof(prologue));
 
-    int stack_offset = -0x10; // offset from %rbp
-    int offset_accumulator = stack_offset; // accumulator address: -0x10(%rbp)
-
-    // hello world
-    write_to_stack(&instruction_stream, "Hello World\n", &stack_offset);
-    int offset_hello_world = stack_offset;
+    // %rsp is 16 byte aligned again: return address, %rbp, %r12 and the accumulator at -0x10(%rbp)
 
-    // source code
-    char* source_code = get_source_code(filename);
-    write_to_stack(&instruction_stream, source_code, &stack_offset);
-    free(source_code);
-    int offset_source = stack_offset;
 
-    // lyrics
-    char* lyrics = get_lyrics(99);
-    write_to_stack(&instruction_stream, lyrics, &stack_offset);
-    free(lyrics);
-    int offset_bottles = stack_offset;
+    generator.stream = &instruction_stream;
+    generator.routines = arena_alloc(&arena, (grammar.rule_count + 1) * sizeof(size_t));
+    generator.length_hello_world = length_hello_world;
+    generator.length_source = length_source;
+    generator.length_bottles = length_bottles;
 
-    // everything after accumulator is text bytes
-    int text_bytes_on_stack = -(stack_offset - offset_accumulator);
 
-
-    /*** parse file ***/
-    while((instruction = fgetc(file)) != EOF)
+    /*** subroutines, jumped over ***/
+    // rules only call rules with lower index, those are already emitted
+    char *r = (char*) &routines_size;
+    char jump [] = {
+        0xE9, r[0], r[1], r[2], r[3] // jmp <main>
+    };
+    vector_push(&instruction_stream, jump, sizeof(jump));
+    for (i = 0; i < grammar.rule_count; i++)
     {
-        switch (instruction)
+        if (grammar.rules[i].uses >= 2)
         {
-            case 'H':
-                {
-                    // access single chars of int
-                    char *hw = (char*) &offset_hello_world;
-                    char opcodes [] = {
-                        0xB0, 00, // movb $0, %al
-                        0x48, 0x8D, 0xBD, hw[0], hw[1], hw[2], hw[3], // leaq -0x<offset>(%rbp),%rdi
-                        0x41, 0xFF, 0xD4 // callq *%r12
-                    };
-                    vector_push(&instruction_stream, opcodes, sizeof(opcodes));
-                }
-                break;
-
-            case 'Q':
-                {
-                    // access single chars of int
-                    char *s = (char*) &offset_source;
-                    char opcodes [] = {
-                        0xB0, 00, // movb $0, %al
-                        0x48, 0x8D, 0xBD, s[0], s[1], s[2], s[3], // leaq -0x<offset>(%rbp),%rdi
-                        0x41, 0xFF, 0xD4 // callq *%r12
-                    };
-                    vector_push(&instruction_stream, opcodes, sizeof(opcodes));
-                }
-                break;
-
-            case '9':
-                {
-                    // access single chars of int
-                    char *b = (char*) &offset_bottles;
-                    char opcodes [] = {
-                        0xB0, 00, // movb $0, %al
-                        0x48, 0x8D, 0xBD, b[0], b[1], b[2], b[3], // leaq -0x<offset>(%rbp),%rdi
-                        // 0xBF, 0x39, 0x00, 0x00, 0x00, // mov $0x39, %edi
-                        0x41, 0xFF, 0xD4 // callq *%r12
-                    };
-                    vector_push(&instruction_stream, opcodes, sizeof(opcodes));
-                }
-                break;
-
-            case '+':
-                {
-                    char *acc = (char*) &offset_accumulator;
-                    char opcodes [] = {
-                        // increment the accumulator
-                        // TODO from variable instead of constant offset
-                        0x48, 0xFF, 0x45, 0xF0, // incq -0x10(%rbp)
-                    };
-                    vector_push(&instruction_stream, opcodes, sizeof(opcodes));
-                }
-                break;
+            generator.routines[i] = instruction_stream.size;
+
+            // entered with the return address on the aligned stack, realign for print
+            char enter [] = {
+                0x48, 0x83, 0xEC, 0x08, // subq $8, %rsp
+            };
+            vector_push(&instruction_stream, enter, sizeof(enter));
+            emit_rule(&generator, GRAMMAR_RULES + (int) i);
+            char leave [] = {
+                0x48, 0x83, 0xC4, 0x08, // addq $8, %rsp
+                0xC3 // ret
+            };
+            vector_push(&instruction_stream, leave, sizeof(leave));
         }
     }
-    if (!feof(file)) {
-        perror("Error reading file");
+
+
+    /*** main ***/
+    for (i = 0; i < grammar.length; i++)
+    {
+        emit_symbol(&generator, grammar.start[i]);
     }
-    fclose(file);
+    grammar_destroy(&grammar);
 
 
     /*** epilogue ***/
-    // access single chars of long
-    char *t = (char*) &text_bytes_on_stack;
     char epilogue [] = {
-        // free strings
-        0x48, 0x81, 0xC4, t[0], t[1], t[2], t[3], // addq $<x>, %rsp
-
         // free accumulator
         0x48, 0x83, 0xC4, 0x08, // addq $8, %rsp
 
@@ -182,162 +254,252 @@ int main(int argc, char **argv)
 
 
     /*** invoke generated code ***/
-    /* allocate and copy instruction stream into executable memory */
-    void* mem = mmap(NULL, instruction_stream.size, PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-    memcpy(mem, instruction_stream.data, instruction_stream.size);
+    if (instruction_stream.size != code_size)
+    {
+        fprintf(stderr, "Error: generated %zu bytes of code, measured %zu\n", instruction_stream.size, code_size);
+        exit(EXIT_FAILURE);
+    }
+
+    /* code and texts were written in place, make the mapping executable */
+    if (mprotect(mem, code_size + text_size, PROT_READ | PROT_EXEC) != 0)
+    {
+        perror("Error protecting generated code");
+        exit(EXIT_FAILURE);
+    }
 
     /* typecast memory to a function pointer and call the dynamically created executable code */
-    void (*hq9p_program) (fn_printf) = mem;
-    hq9p_program(printf);
+    if (compressed)
+    {
+        void (*hq9p_program) (fn_print_compressed*) = mem;
+        hq9p_program(print_compressed);
+        if (lz_writer_destroy(&compressed_output) != 0)
+        {
+            perror("Error writing output");
+            exit(EXIT_FAILURE);
+        }
+    }
+    else
+    {
+        void (*hq9p_program) (fn_print*) = mem;
+        cache_begin(&cache);
+        hq9p_program(print);
+        cache_end(&cache);
+    }
 
     /* clear up */
-    munmap(mem, instruction_stream.size);
-    vector_destroy(&instruction_stream);
+    munmap(mem, mapping_size);
+    arena_destroy(&arena);
 
     exit(EXIT_SUCCESS);
 }
 
-void write_to_stack(struct vector* const stream, char* text, int* stack_offset)
+void emit_instruction(char instruction, char* filename)
 {
-    /*
-        Calculate and allocate required stack space (8 aligned, with \0 terminator),
-        then push quads (8 byte) on stack in reverse order. Finally fill incomplete
-        quad with zeros (which act as \0 terminator) or add quad with \0 terminator.
-
-        string_length; required_space_aligned; example
-         0    8   "00000000"    <- \0 terminator + 7 zeros
-         1    8   "H0000000"
-         2    8   "He000000"
-         3    8   "Hel00000"
-         4    8   "Hell0000"
-         5    8   "Hello000"
-         6    8   "Hello 00"
-         7    8   "Hello W0"
-         8   16   "00000000" "Hello Wo"    <- 1 additional quad for \0 terminator
-         9   16   "r0000000" "Hello Wo"
-        10   16   "rl000000" "Hello Wo"
-        11   16   "rld00000" "Hello Wo"
-        12   16   ...
-        13   16   ...
-        14   16   ...
-        15   16   ...
-        16   24   ...    <- 1 additional quad for \0 terminator
-        17   24   ...
-        18   24   ...
-        19   24   ...
-    */
-
-    // calculate stack space
-    int length = strlen(text);
-    int required_space_aligned = length + 8 - (length) % 8;
+    /* same output as the generated code */
+    struct arena arena;
+    char* text;
+    size_t source_length;
+    int lyrics_length;
+
+    arena_create(&arena, 16 * 1024);
+    switch (instruction)
+    {
+        case 'H':
+            print("hello, world\n", 13);
+            break;
+        case 'Q':
+            text = get_source_code(&arena, filename, &source_length);
+            print(text, source_length);
+            break;
+        case '9':
+            text = get_lyrics(&arena, 99, &lyrics_length);
+            print(text, lyrics_length);
+            break;
+    }
+    arena_destroy(&arena);
+}
 
-    // allocate stack space
-    char *s = (char*) &required_space_aligned;
-    char allocate [] = {
-        0x48, 0x81, 0xEC, s[0], s[1], s[2], s[3] // subq $0x<required_space_aligned>, %rsp
-    };
-    vector_push(stream, allocate, sizeof(allocate));
-    *stack_offset -= required_space_aligned;
+void emit_symbol(struct code_generator* const generator, int symbol)
+{
+    if (generator->compressed)
+    {
+        switch (symbol)
+        {
+            case 'H': emit_reference(generator->stream, LZ_HELLO); return;
+            case 'Q': emit_reference(generator->stream, LZ_SOURCE); return;
+            case '9': emit_reference(generator->stream, LZ_LYRICS); return;
+        }
+    }
 
-    /*
-        push chars in quads on the stack (in reverse order, e.g. ... "rld00000" "hello wo")
+    switch (symbol)
+    {
+        case 'H':
+            emit_print(generator->stream, generator->offset_hello_world, generator->length_hello_world);
+            return;
 
-        pushing immediate with pushq is not supported or leaves zeros:
-        https://stackoverflow.com/questions/13351363/push-on-64bit-intel-osx
+        case 'Q':
+            emit_print(generator->stream, generator->offset_source, generator->length_source);
+            return;
 
-        thus move into register first, then move register to stack:
-        movq $0x6f57206f6c6c6548, %rax
-        movq %rax,-0x20(%rbp)
-    */
-    int write_pos = *stack_offset; // where to write on stack
-    int chars_written = 0;
-    char* char_ptr;
-    for (char_ptr = text; *char_ptr != '\0'; char_ptr++){
-        if(chars_written % 8 == 0) {
-            vector_push_byte(stream, 0x48); // movq $<char1, char2, ..., char8>, %rax
-            vector_push_byte(stream, 0xB8);
-        }
+        case '9':
+            emit_print(generator->stream, generator->offset_bottles, generator->length_bottles);
+            return;
 
-        vector_push_byte(stream, *char_ptr); // $<char1, char2, ..., char8>
-        chars_written++;
+        case '+':
+            {
+                char opcodes [] = {
+                    // increment the accumulator
+                    // TODO from variable instead of constant offset
+                    0x48, 0xFF, 0x45, 0xF0, // incq -0x10(%rbp)
+                };
+                vector_push(generator->stream, opcodes, sizeof(opcodes));
+            }
+            return;
+    }
 
-        if(chars_written % 8 == 0) {
-            char *pos = (char*) &write_pos;
-            char mov_to_stack [] = {
-                0x48, 0x89, 0x85, pos[0], pos[1], pos[2], pos[3] // movq %rax,<write_pos>(%rbp)
-            };
-            vector_push(stream, mov_to_stack, sizeof(mov_to_stack));
-            write_pos += 8; // move stack up by 1 quad
-        }
+    if (GRAMMAR_RULE(generator->grammar, symbol)->uses < 2)
+    {
+        emit_rule(generator, symbol);
+        return;
     }
 
-    // if just completed pushing a quad, need to add '\0' terminator
-    if(chars_written % 8 == 0) {
-        char terminator [] = {
-            0x48, 0xB8, '\0' // movq $0x00, %rax
-        };
-        vector_push(stream, terminator, sizeof(terminator));
-        chars_written++;
+    // subroutines precede all their calls
+    int rel = generator->routines[symbol - GRAMMAR_RULES] - (generator->stream->size + CALL_SIZE);
+    char *c = (char*) &rel;
+    char call [] = {
+        0xE8, c[0], c[1], c[2], c[3] // callq <routine>
+    };
+    vector_push(generator->stream, call, sizeof(call));
+}
+
+void emit_rule(struct code_generator* const generator, int symbol)
+{
+    struct grammar_rule* rule = GRAMMAR_RULE(generator->grammar, symbol);
+    if (rule->kind == GRAMMAR_PAIR)
+    {
+        emit_symbol(generator, rule->left);
+        emit_symbol(generator, rule->right);
+        return;
     }
 
-    // if quad not completely filled, fill remaining bytes with 0. will also act as '\0' terminator
-    if(chars_written %8 != 0) {
-        while(chars_written % 8 != 0) {
-            vector_push_byte(stream, '\0');
-            chars_written++;
+    if (!grammar_is_loop(generator->grammar, &generator->sizes, rule))
+    {
+        for (unsigned long i = 0; i < rule->count; i++)
+        {
+            emit_symbol(generator, rule->left);
         }
-        char *pos = (char*) &write_pos;
-        char mov_to_stack [] = {
-            0x48, 0x89, 0x85, pos[0], pos[1], pos[2], pos[3] // mov %rax,<write_pos>(%rbp)
-        };
-        vector_push(stream, mov_to_stack, sizeof(mov_to_stack));
+        return;
     }
 
+    // counter on the stack, 16 bytes keep %rsp aligned
+    char *n = (char*) &rule->count;
+    char setup [] = {
+        0x48, 0x83, 0xEC, 0x10, // subq $16, %rsp
+        0x48, 0xB8, n[0], n[1], n[2], n[3], n[4], n[5], n[6], n[7], // movabsq $<count>, %rax
+        0x48, 0x89, 0x04, 0x24, // movq %rax, (%rsp)
+    };
+    vector_push(generator->stream, setup, sizeof(setup));
+    size_t loop = generator->stream->size;
+
+    emit_symbol(generator, rule->left);
+
+    int rel = loop - (generator->stream->size + 4 + 6);
+    char *l = (char*) &rel;
+    char teardown [] = {
+        0x48, 0xFF, 0x0C, 0x24, // decq (%rsp)
+        0x0F, 0x85, l[0], l[1], l[2], l[3], // jnz <loop>
+        0x48, 0x83, 0xC4, 0x10, // addq $16, %rsp
+    };
+    vector_push(generator->stream, teardown, sizeof(teardown));
 }
 
-char* get_source_code(char* filename)
+void emit_print(struct vector* const stream, size_t offset, int length)
 {
-    FILE *file;
-    long length;
-    char *buffer;
-
-    /* Open file again for second independent seek point indicator.
-       Read only -> No problem to have same file open multiple times. */
-    file = fopen(filename, "r");
-    if (file == NULL)
-    {
-        perror("Error opening file");
-        exit(EXIT_FAILURE);
-    }
+    // the text follows the code, relative to the end of leaq
+    int rel = offset - (stream->size + 7);
+    // access single chars of int
+    char *o = (char*) &rel;
+    char *l = (char*) &length;
+    char opcodes [] = {
+        0x48, 0x8D, 0x3D, o[0], o[1], o[2], o[3], // leaq <rel>(%rip),%rdi
+        0xBE, l[0], l[1], l[2], l[3], // movl $<length>, %esi
+        0x41, 0xFF, 0xD4 // callq *%r12
+    };
+    vector_push(stream, opcodes, sizeof(opcodes));
+}
+
+void emit_reference(struct vector* const stream, int segment)
+{
+    char opcodes [] = {
+        0xBF, segment, 0x00, 0x00, 0x00, // movl $<segment>, %edi
+        0x41, 0xFF, 0xD4 // callq *%r12
+    };
+    vector_push(stream, opcodes, sizeof(opcodes));
+}
+
+void print(const char* text, size_t length)
+{
+    fwrite(text, 1, length, stdout);
+}
+
+void print_compressed(int segment)
+{
+    // the segment is a reference into the preloaded dictionary
+    lz_reference(&compressed_output, segment);
+}
 
-    /* get file length */
-    fseek(file , 0L , SEEK_END);
-    length = ftell(file);
-    rewind(file);
-
-    /* allocate memory for file content */
-    buffer = malloc(length+1);
-    if(buffer == NULL) {
-         fclose(file);
-         perror("Error allocating memory for source code");
-         exit(EXIT_FAILURE);
+void* map_code(size_t size, size_t* mapping_size)
+{
+    char* mem;
+
+    if (size < HUGE_PAGE_SIZE) {
+        *mapping_size = size;
+        mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED) {
+            perror("Error mapping generated code");
+            exit(EXIT_FAILURE);
+        }
+        return mem;
     }
 
-    /* copy the file into the buffer */
-    if(fread(buffer, 1, length, file) != length) {
-        fclose(file);
-        free(buffer);
-        perror("Could not read file into buffer");
+    /*
+        Megabytes of generated code and texts: back them by transparent huge pages to save iTLB misses.
+        Over-allocate by one huge page and trim, so the code starts at a huge page boundary.
+    */
+    *mapping_size = (size + HUGE_PAGE_SIZE - 1) & ~(size_t) (HUGE_PAGE_SIZE - 1);
+    char* reserved = mmap(NULL, *mapping_size + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (reserved == MAP_FAILED) {
+        perror("Error mapping generated code");
         exit(EXIT_FAILURE);
     }
+    mem = (char*) (((size_t) reserved + HUGE_PAGE_SIZE - 1) & ~(size_t) (HUGE_PAGE_SIZE - 1));
+    if (mem > reserved) {
+        munmap(reserved, mem - reserved);
+    }
+    munmap(mem + *mapping_size, reserved + HUGE_PAGE_SIZE - mem);
+#ifdef MADV_HUGEPAGE
+    madvise(mem, *mapping_size, MADV_HUGEPAGE); // only a hint, fine to fail
+#endif
+    return mem;
+}
 
-    /* Close second file descriptor */
-    fclose(file);
+void* grow_in_arena(void* arena, void* data, size_t size, size_t new_size)
+{
+    return arena_grow(arena, data, size, new_size);
+}
 
+char* get_source_code(struct arena* const arena, char* filename, size_t* source_length)
+{
+    char* buffer = source_read(filename, source_length, grow_in_arena, arena);
+    if (buffer == NULL)
+    {
+        perror("Could not read file into buffer");
+        exit(EXIT_FAILURE);
+    }
     return buffer;
 }
 
-char* get_lyrics(int initial_bottle_count)
+char* get_lyrics(struct arena* const arena, int initial_bottle_count, int* length)
 {
     int bottle_count;
     char* pluralized_bottle;
@@ -346,9 +508,8 @@ char* get_lyrics(int initial_bottle_count)
     char line_buffer[MAX_LINE_LENGTH];
     int chars_to_write;
     struct vector lyrics_stream;
-    char* buffer;
 
-    vector_create(&lyrics_stream, 100);
+    vector_create(&lyrics_stream, arena, 16 * 1024);
 
     // create formated strings and put them into a vector.
     for (bottle_count = initial_bottle_count; bottle_count >= 0; bottle_count--)
@@ -381,11 +542,9 @@ char* get_lyrics(int initial_bottle_count)
         }
     }
 
-    // copy data to buffer so the vector can be freed.
-    buffer = malloc(lyrics_stream.size);
-    memcpy(buffer, lyrics_stream.data, lyrics_stream.size);
-
-    vector_destroy(&lyrics_stream);
+    // the vector lives in the arena, no copy required
+    *length = lyrics_stream.size;
+    vector_push_byte(&lyrics_stream, '\0');
 
-    return buffer;
+    return lyrics_stream.data;
 }
@@ -1,23 +1,36 @@
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include "arena.h"
 #include "vector.h"
 
-void vector_create (struct vector* const vec, size_t capacity) {
+void vector_create (struct vector* const vec, struct arena* const arena, size_t capacity) {
     vec->size = 0;
     vec->capacity = capacity;
-    vec->data = malloc(capacity * sizeof(char));
+    vec->arena = arena;
+    vec->data = arena_alloc(arena, capacity * sizeof(char));
 }
 
-void vector_destroy (struct vector* vec) {
-    if (vec->data != NULL) {
-        free(vec->data);
-    }
+void vector_wrap (struct vector* const vec, void* data, size_t capacity) {
+    // fixed capacity, e.g. the final mapping of the generated code
+    vec->size = 0;
+    vec->capacity = capacity;
+    vec->arena = NULL;
+    vec->data = data;
 }
 
 void vector_push (struct vector* const vec, char* bytes, size_t len) {
     if (vec->size + len > vec->capacity) {
-        vec->capacity *= 2;
-        vec->data = realloc(vec->data, vec->capacity * sizeof(char));
+        size_t capacity = vec->capacity;
+        if (vec->arena == NULL) {
+            fprintf(stderr, "Error: fixed size vector overflow\n");
+            exit(EXIT_FAILURE);
+        }
+        while (vec->size + len > capacity) {
+            capacity = capacity == 0 ? 16 : capacity * 2;
+        }
+        vec->data = arena_grow(vec->arena, vec->data, vec->size, capacity * sizeof(char));
+        vec->capacity = capacity;
     }
     memcpy(vec->data + vec->size, bytes, len);
     vec->size += len;
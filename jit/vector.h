@@ -1,10 +1,13 @@
+struct arena;
+
 struct vector {
   size_t size;
   size_t capacity;
   char* data;
+  struct arena* arena;
 };
 
-void vector_create (struct vector* const vec, size_t capacity);
-void vector_destroy (struct vector* vec);
+void vector_create (struct vector* const vec, struct arena* const arena, size_t capacity);
+void vector_wrap (struct vector* const vec, void* data, size_t capacity);
 void vector_push (struct vector* const vec, char* bytes, size_t len);
 void vector_push_byte (struct vector* const vec, char byte);
@@ -0,0 +1,122 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "process.h"
+
+/*
+Running HQ9+ engines as child processes, shared by the driver and the conformance gate.
+
+The compiler backends leave their intermediate files next to <build>, callers
+pick a scratch location and remove them when they are done.
+*/
+
+int process_execute(char* const argv[], const char* input, const char* output)
+{
+    pid_t pid;
+    int status;
+    int fd;
+
+    fflush(stdout);
+    pid = fork();
+    if (pid < 0)
+    {
+        perror("Error forking");
+        return -1;
+    }
+    if (pid == 0)
+    {
+        if (input != NULL)
+        {
+            fd = open(input, O_RDONLY);
+            if (fd < 0)
+            {
+                _exit(127);
+            }
+            dup2(fd, STDIN_FILENO);
+            close(fd);
+        }
+        if (output != NULL)
+        {
+            fd = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (fd < 0)
+            {
+                _exit(127);
+            }
+            dup2(fd, STDOUT_FILENO);
+            close(fd);
+        }
+        execvp(argv[0], argv);
+        perror(argv[0]);
+        _exit(127);
+    }
+    if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status))
+    {
+        return -1;
+    }
+    return WEXITSTATUS(status);
+}
+
+int process_run(const char* engine, const char* program, const char* output)
+{
+    char* argv[3];
+    argv[0] = (char*) engine;
+    argv[1] = (char*) program;
+    argv[2] = NULL;
+    return process_execute(argv, NULL, output);
+}
+
+int process_run_compiled(const char* compiler, const char* program, const char* build, const char* output)
+{
+    char assembly[PROCESS_PATH_MAX];
+    char binary[PROCESS_PATH_MAX];
+    char* argv_compile[3];
+    char* argv_assemble[] = { "gcc", "-no-pie", "-nostartfiles", "-o", NULL, "-xassembler", NULL, NULL };
+    char* argv_run[2];
+
+    snprintf(assembly, sizeof(assembly), "%s.s", build);
+    snprintf(binary, sizeof(binary), "%s.bin", build);
+
+    argv_compile[0] = (char*) compiler;
+    argv_compile[1] = (char*) program;
+    argv_compile[2] = NULL;
+    argv_assemble[4] = binary;
+    argv_assemble[6] = assembly;
+    argv_run[0] = binary;
+    argv_run[1] = NULL;
+
+    if (process_execute(argv_compile, NULL, assembly) != 0 || process_execute(argv_assemble, NULL, NULL) != 0)
+    {
+        return -1;
+    }
+    return process_execute(argv_run, NULL, output);
+}
+
+int process_run_compiled_c(const char* compiler, const char* program, const char* build, const char* output)
+{
+    char source[PROCESS_PATH_MAX];
+    char binary[PROCESS_PATH_MAX];
+    char* argv_compile[4];
+    char* argv_build[] = { "gcc", "-O2", "-o", NULL, "-xc", NULL, NULL };
+    char* argv_run[2];
+
+    snprintf(source, sizeof(source), "%s.c", build);
+    snprintf(binary, sizeof(binary), "%s.c.bin", build);
+
+    argv_compile[0] = (char*) compiler;
+    argv_compile[1] = "-c";
+    argv_compile[2] = (char*) program;
+    argv_compile[3] = NULL;
+    argv_build[3] = binary;
+    argv_build[5] = source;
+    argv_run[0] = binary;
+    argv_run[1] = NULL;
+
+    if (process_execute(argv_compile, NULL, source) != 0 || process_execute(argv_build, NULL, NULL) != 0)
+    {
+        return -1;
+    }
+    return process_execute(argv_run, NULL, output);
+}
@@ -0,0 +1,13 @@
+#define PROCESS_PATH_MAX 4096
+
+/* run a program, optionally with stdin and stdout redirected to files, returns its exit status or -1 */
+int process_execute (char* const argv[], const char* input, const char* output);
+
+/* run an engine that executes the program directly (interpreter, jit compiler) */
+int process_run (const char* engine, const char* program, const char* output);
+
+/* compile the program to <build>.s, assemble it to <build>.bin and run it */
+int process_run_compiled (const char* compiler, const char* program, const char* build, const char* output);
+
+/* compile the program to <build>.c, build it with gcc -O2 to <build>.c.bin and run it */
+int process_run_compiled_c (const char* compiler, const char* program, const char* build, const char* output);
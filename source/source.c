@@ -0,0 +1,82 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "source.h"
+
+/*
+Whole-file reader shared by all engines and tools that need a program's source.
+
+Regular files are read with a single allocation of their size; files whose size
+is unknown up front (pipes, character devices) grow their buffer by doubling.
+*/
+
+static void* grow_heap(void* context, void* buffer, size_t size, size_t new_size)
+{
+    return realloc(buffer, new_size);
+}
+
+char* source_read(const char* filename, size_t* length, source_grow_fn* grow, void* context)
+{
+    FILE *file;
+    char *buffer;
+    char *grown;
+    size_t capacity = 4096;
+    size_t read;
+    long size;
+
+    file = fopen(filename, "rb");
+    if (file == NULL)
+    {
+        return NULL;
+    }
+    if (grow == NULL)
+    {
+        grow = grow_heap;
+    }
+
+    /* size hint, one spare byte for the terminator and one to see the end of file */
+    if (fseek(file, 0L, SEEK_END) == 0 && (size = ftell(file)) >= 0)
+    {
+        capacity = (size_t) size + 2;
+    }
+    rewind(file);
+
+    buffer = grow(context, NULL, 0, capacity);
+    if (buffer == NULL)
+    {
+        fclose(file);
+        return NULL;
+    }
+    *length = 0;
+    while ((read = fread(buffer + *length, 1, capacity - 1 - *length, file)) > 0)
+    {
+        *length += read;
+        if (*length == capacity - 1)
+        {
+            grown = grow(context, buffer, capacity, capacity * 2);
+            if (grown == NULL)
+            {
+                if (grow == grow_heap)
+                {
+                    free(buffer);
+                }
+                fclose(file);
+                return NULL;
+            }
+            buffer = grown;
+            capacity *= 2;
+        }
+    }
+    if (ferror(file))
+    {
+        if (grow == grow_heap)
+        {
+            free(buffer);
+        }
+        fclose(file);
+        return NULL;
+    }
+
+    buffer[*length] = '\0';
+    fclose(file);
+    return buffer;
+}
@@ -0,0 +1,9 @@
+/* grows a buffer of size bytes to new_size bytes, like realloc */
+typedef void* source_grow_fn (void* context, void* buffer, size_t size, size_t new_size);
+
+/*
+    Reads a whole file into a '\0' terminated buffer (the length counts only the file,
+    which may contain '\0' itself). Memory comes from grow(context, ...), or from
+    realloc if grow is NULL. Returns NULL if the file cannot be read.
+*/
+char* source_read (const char* filename, size_t* length, source_grow_fn* grow, void* context);